@@ -7,6 +7,7 @@ main(int argc, char **argv)
 
   FUSE.init(argc, argv);
   FUSE.createRootDir();
+  FUSE.checkParents();
 
   return fuse_main(
       FUSE.args.argc,
@@ -0,0 +1,447 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ *
+ * Migrates the files documents of a gridfs filesystem while it's
+ * mounted. Every step selects the documents that still need to be
+ * converted, one thread reads them and a number of worker threads
+ * update them in parallel. The updates are conditional, i.e. documents
+ * changed by a mount in the meantime aren't overwritten, and a step
+ * can be run again at any time.
+ */
+#include <mongo/client/redef_macros.h> //To fix ill-defined macros
+#include <mongo/client/dbclient.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "metadata.h"
+#include "lock.h"
+
+namespace {
+
+  struct Options
+  {
+    Options()
+      : conn_string("localhost:27017"),
+        collection_prefix("fs"),
+        default_uid(getuid()),
+        default_gid(getgid()),
+        threads(8)
+    {}
+
+    std::string conn_string;
+    std::string db;
+    std::string collection_prefix;
+    std::string user;
+    std::string password;
+    uid_t default_uid;
+    gid_t default_gid;
+    unsigned int threads;
+  } theOptions;
+
+  /**
+   * a migration step
+   */
+  struct Step
+  {
+    const char* name;
+    const char* description;
+
+    // the documents that still need to be converted
+    mongo::BSONObj (*query)();
+
+    // the fields needed by convert
+    mongo::BSONObj (*fields)();
+
+    // the conditional update of a document, returns false to skip it
+    bool (*convert)(
+        const mongo::BSONObj& aFile,
+        mongo::BSONObj& aCondition,
+        mongo::BSONObj& aUpdate);
+  };
+
+  // metadata: contentType "m:..|u:..|g:..|t:.." -> metadata subdocument
+
+  mongo::BSONObj
+  metadata_query()
+  {
+    return BSON("metadata.mode" << BSON("$exists" << false));
+  }
+
+  mongo::BSONObj
+  metadata_fields()
+  {
+    return BSON("_id" << 1 << "contentType" << 1 << "metadata" << 1);
+  }
+
+  bool
+  metadata_convert(
+      const mongo::BSONObj& aFile,
+      mongo::BSONObj& aCondition,
+      mongo::BSONObj& aUpdate)
+  {
+    gridfs::Metadata lMetadata(aFile, theOptions.default_uid, theOptions.default_gid);
+
+    aCondition = BSON(
+        "_id" << aFile["_id"] <<
+        "metadata.mode" << BSON("$exists" << false));
+
+    mongo::BSONElement lUserMetadata = aFile["metadata"];
+    if (lUserMetadata.eoo() || lUserMetadata.type() == mongo::Object)
+    {
+      // keep user defined metadata fields
+      mongo::BSONObjBuilder lSet;
+      mongo::BSONObjIterator lIt(lMetadata.toBSON());
+      while (lIt.more())
+      {
+        mongo::BSONElement lField = lIt.next();
+        lSet.appendAs(lField, (std::string("metadata.") + lField.fieldName()).c_str());
+      }
+      aUpdate = BSON("$set" << lSet.obj());
+    }
+    else
+    {
+      aUpdate = BSON("$set" << BSON("metadata" << lMetadata.toBSON()));
+    }
+    return true;
+  }
+
+  // parent: set the indexed path of the containing directory
+
+  mongo::BSONObj
+  parent_query()
+  {
+    return BSON("parent" << BSON("$exists" << false));
+  }
+
+  mongo::BSONObj
+  parent_fields()
+  {
+    return BSON("_id" << 1 << "filename" << 1);
+  }
+
+  bool
+  parent_convert(
+      const mongo::BSONObj& aFile,
+      mongo::BSONObj& aCondition,
+      mongo::BSONObj& aUpdate)
+  {
+    // same as FilesystemEntry::parentPath, the root has no parent
+    std::string lPath = aFile.getStringField("filename");
+    size_t lSlash = lPath.rfind('/');
+    if (lSlash == std::string::npos)
+      return false;
+
+    aCondition = BSON(
+        "_id" << aFile["_id"] <<
+        "parent" << BSON("$exists" << false));
+    aUpdate = BSON("$set" << BSON("parent" << lPath.substr(0, lSlash)));
+    return true;
+  }
+
+  Step theSteps[] = {
+    { "metadata",
+      "convert the attributes stored in contentType into a metadata subdocument",
+      metadata_query, metadata_fields, metadata_convert },
+    { "parent",
+      "add the parent field used for listing directories",
+      parent_query, parent_fields, parent_convert },
+    { NULL, NULL, NULL, NULL, NULL }
+  };
+
+  /**
+   * bounded queue of documents between the reader and the workers
+   */
+  class Queue
+  {
+    public:
+      Queue(size_t aMaxSize)
+        : theMaxSize(aMaxSize),
+          theClosed(false)
+      {
+        pthread_mutex_init(&theMutex, NULL);
+        pthread_cond_init(&theNotEmpty, NULL);
+        pthread_cond_init(&theNotFull, NULL);
+      }
+
+      ~Queue()
+      {
+        pthread_cond_destroy(&theNotFull);
+        pthread_cond_destroy(&theNotEmpty);
+        pthread_mutex_destroy(&theMutex);
+      }
+
+      void
+      push(const mongo::BSONObj& aFile)
+      {
+        gridfs::Lock lLock(theMutex);
+        while (theFiles.size() >= theMaxSize)
+          pthread_cond_wait(&theNotFull, &theMutex);
+        theFiles.push_back(aFile.getOwned());
+        pthread_cond_signal(&theNotEmpty);
+      }
+
+      // returns false once the queue is closed and empty
+      bool
+      pop(mongo::BSONObj& aFile)
+      {
+        gridfs::Lock lLock(theMutex);
+        while (theFiles.empty() && !theClosed)
+          pthread_cond_wait(&theNotEmpty, &theMutex);
+        if (theFiles.empty())
+          return false;
+        aFile = theFiles.front();
+        theFiles.pop_front();
+        pthread_cond_signal(&theNotFull);
+        return true;
+      }
+
+      void
+      close()
+      {
+        gridfs::Lock lLock(theMutex);
+        theClosed = true;
+        pthread_cond_broadcast(&theNotEmpty);
+      }
+
+    private:
+      pthread_mutex_t theMutex;
+      pthread_cond_t theNotEmpty;
+      pthread_cond_t theNotFull;
+      std::deque<mongo::BSONObj> theFiles;
+      size_t theMaxSize;
+      bool theClosed;
+  };
+
+  struct Worker
+  {
+    pthread_t thread;
+    Queue* queue;
+    const Step* step;
+    unsigned long long converted;
+    unsigned long long skipped;
+    bool failed;
+  };
+
+  std::string
+  files_collection()
+  {
+    return theOptions.db + "." + theOptions.collection_prefix + ".files";
+  }
+
+  mongo::DBClientBase*
+  connect()
+  {
+    std::string lErrMsg;
+    mongo::ConnectionString lConString =
+      mongo::ConnectionString::parse(theOptions.conn_string, lErrMsg);
+    if (!lConString.isValid())
+    {
+      std::cerr << "invalid connection string: " << lErrMsg << std::endl;
+      exit(1);
+    }
+
+    mongo::DBClientBase* lConn = lConString.connect(lErrMsg);
+    if (!lConn)
+    {
+      std::cerr << "couldn't connect to " << theOptions.conn_string
+                << ": " << lErrMsg << std::endl;
+      exit(2);
+    }
+
+    if (!theOptions.user.empty() &&
+        !lConn->auth(theOptions.db, theOptions.user, theOptions.password, lErrMsg))
+    {
+      std::cerr << "couldn't authenticate with user " << theOptions.user
+                << ": " << lErrMsg << std::endl;
+      exit(3);
+    }
+    return lConn;
+  }
+
+  void*
+  work(void* aWorker)
+  {
+    Worker* lWorker = static_cast<Worker*>(aWorker);
+    std::auto_ptr<mongo::DBClientBase> lConn(connect());
+    const std::string lCollection = files_collection();
+
+    try
+    {
+      mongo::BSONObj lFile;
+      while (lWorker->queue->pop(lFile))
+      {
+        mongo::BSONObj lCondition;
+        mongo::BSONObj lUpdate;
+        if (!lWorker->step->convert(lFile, lCondition, lUpdate))
+          continue;
+
+        // the condition doesn't match if a mount changed the
+        // document in the meantime, that's not an error
+        lConn->update(lCollection, lCondition, lUpdate);
+        mongo::BSONObj lResult = lConn->getLastErrorDetailed();
+        if (lResult.getField("err").ok() && !lResult.getField("err").isNull())
+        {
+          std::cerr << "update of " << lFile["_id"].toString(false)
+                    << " failed: " << lResult.jsonString() << std::endl;
+          lWorker->failed = true;
+        }
+        else if (lResult["n"].numberInt() == 0)
+          ++lWorker->skipped;
+        else
+          ++lWorker->converted;
+      }
+    }
+    catch (std::exception& e)
+    {
+      std::cerr << "exception: " << e.what() << std::endl;
+      lWorker->failed = true;
+
+      // keep draining such that the reader doesn't block forever
+      mongo::BSONObj lFile;
+      while (lWorker->queue->pop(lFile)) {}
+    }
+    return NULL;
+  }
+
+  int
+  run(const Step& aStep)
+  {
+    std::auto_ptr<mongo::DBClientBase> lConn(connect());
+
+    Queue lQueue(1024 * theOptions.threads);
+    std::vector<Worker> lWorkers(theOptions.threads);
+    for (size_t i = 0; i < lWorkers.size(); ++i)
+    {
+      lWorkers[i].queue = &lQueue;
+      lWorkers[i].step = &aStep;
+      lWorkers[i].converted = 0;
+      lWorkers[i].skipped = 0;
+      lWorkers[i].failed = false;
+      pthread_create(&lWorkers[i].thread, NULL, work, &lWorkers[i]);
+    }
+
+    int lResult = 0;
+    unsigned long long lRead = 0;
+    try
+    {
+      mongo::BSONObj lFields = aStep.fields();
+      std::auto_ptr<mongo::DBClientCursor> lCursor = lConn->query(
+          files_collection(),
+          mongo::Query(aStep.query()).snapshot(),
+          0, 0, &lFields,
+          mongo::QueryOption_NoCursorTimeout);
+
+      while (lCursor->more())
+      {
+        lQueue.push(lCursor->next());
+        ++lRead;
+      }
+    }
+    catch (std::exception& e)
+    {
+      std::cerr << "exception: " << e.what() << std::endl;
+      lResult = 4;
+    }
+
+    lQueue.close();
+
+    unsigned long long lConverted = 0;
+    unsigned long long lSkipped = 0;
+    for (size_t i = 0; i < lWorkers.size(); ++i)
+    {
+      pthread_join(lWorkers[i].thread, NULL);
+      lConverted += lWorkers[i].converted;
+      lSkipped += lWorkers[i].skipped;
+      if (lWorkers[i].failed)
+        lResult = 5;
+    }
+
+    std::cout << aStep.name << ": " << lRead << " documents selected, "
+              << lConverted << " updated, " << lSkipped
+              << " changed in the meantime" << std::endl;
+    return lResult;
+  }
+
+  void
+  usage(const char* aProgram)
+  {
+    std::cerr
+      << "usage: " << aProgram << " [options] STEP" << std::endl
+      << std::endl
+      << "steps:" << std::endl;
+    for (const Step* lStep = theSteps; lStep->name; ++lStep)
+      std::cerr << "  " << lStep->name << ": " << lStep->description << std::endl;
+    std::cerr
+      << std::endl
+      << "options:" << std::endl
+      << "  --mongo_db=STRING                 database name (mandatory)" << std::endl
+      << "  --mongo_conn_string=STRING        connection string (default: localhost:27017)" << std::endl
+      << "  --mongo_user=STRING               user name for mongo db authentication" << std::endl
+      << "  --mongo_password=STRING           password for mongo db authentication" << std::endl
+      << "  --mongo_collection_prefix=STRING  prefix for the gridfs collections (default: fs)" << std::endl
+      << "  --default_uid=INT                 user id of legacy entries without one" << std::endl
+      << "  --default_gid=INT                 group id of legacy entries without one" << std::endl
+      << "  --threads=INT                     number of update threads (default: 8)" << std::endl;
+    exit(1);
+  }
+
+  // sets aValue if aArg is --aName=value
+  bool
+  option(const char* aArg, const char* aName, std::string& aValue)
+  {
+    size_t lLength = strlen(aName);
+    if (strncmp(aArg, "--", 2) != 0 ||
+        strncmp(aArg + 2, aName, lLength) != 0 ||
+        aArg[2 + lLength] != '=')
+      return false;
+
+    aValue = aArg + 3 + lLength;
+    return true;
+  }
+
+}
+
+int
+main(int argc, char** argv)
+{
+  const Step* lStep = NULL;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string lValue;
+    if (option(argv[i], "mongo_conn_string", theOptions.conn_string) ||
+        option(argv[i], "mongo_db", theOptions.db) ||
+        option(argv[i], "mongo_collection_prefix", theOptions.collection_prefix) ||
+        option(argv[i], "mongo_user", theOptions.user) ||
+        option(argv[i], "mongo_password", theOptions.password))
+      continue;
+
+    if (option(argv[i], "default_uid", lValue))
+      theOptions.default_uid = strtoul(lValue.c_str(), NULL, 10);
+    else if (option(argv[i], "default_gid", lValue))
+      theOptions.default_gid = strtoul(lValue.c_str(), NULL, 10);
+    else if (option(argv[i], "threads", lValue))
+      theOptions.threads = strtoul(lValue.c_str(), NULL, 10);
+    else
+    {
+      for (lStep = theSteps; lStep->name; ++lStep)
+        if (strcmp(lStep->name, argv[i]) == 0)
+          break;
+
+      if (!lStep->name)
+        usage(argv[0]);
+    }
+  }
+
+  if (!lStep || theOptions.db.empty() || theOptions.threads == 0)
+    usage(argv[0]);
+
+  return run(*lStep);
+}
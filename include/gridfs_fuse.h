@@ -6,9 +6,12 @@
 #include <fuse.h>
 
 #include <string>
+#include <vector>
+#include <utility>
 #include <stddef.h>
 #include <stdio.h>
 #include <syslog.h>
+#include <boost/shared_ptr.hpp>
 
 
 namespace mongo
@@ -44,29 +47,142 @@ namespace gridfs
     unsigned int default_uid;
     unsigned int default_gid;
     unsigned int mongo_chunk_size;
+    unsigned int mongo_min_chunk_size;
+    unsigned int mongo_max_chunk_size;
+    char* mongo_chunk_size_rules;
+    unsigned int inline_threshold;
+    unsigned int attr_cache_size;
+    unsigned int attr_cache_ttl;
+    unsigned int memcached_negative_ttl;
+    unsigned int list_by_regex;
+    unsigned int readdir_batch_size;
+    unsigned int listing_cache_size;
+    unsigned int listing_cache_max_entries;
+    unsigned int memcached_ttl;
+    unsigned int oplog_tail;
+    unsigned int namespace_index;
+    unsigned int namespace_index_threads;
+    unsigned int unlink_batch_size;
+    unsigned int statfs_interval;
+    unsigned int capacity_gb;
+    char* cache;
+    unsigned int local_cache_mb;
+    unsigned int local_cache_ttl;
+    unsigned int migration_window;
+    unsigned int io_threads;
+    unsigned int readahead_chunks;
+    char* read_preference;
+    unsigned int max_staleness;
   };
 
   class Fuse;
-
+  class AttributeCache;
+  class ListingCache;
+  class OplogTailer;
+  class NamespaceIndex;
+  class Unlinker;
+  class Statistics;
+  class CacheBackend;
+  class MemcacheRing;
+  class IoExecutor;
+  class ReadRouter;
+
+  // attribute cache consisting of an in-process cache (see AttributeCache)
+  // in front of the cache backend chosen with -o cache (see CacheBackend),
+  // which is only asked if the in-process cache cannot answer.
   class Memcache
   {
-  protected:
-    friend class Fuse;
-    memcached_st* m;
-
   public:
-    Memcache();
+    enum Result
+    {
+      UNKNOWN = 0, // nothing cached
+      EXISTS  = 1, // cached attributes
+      MISSING = 2  // path is known not to exist
+    };
+
+    typedef std::vector<std::pair<std::string, struct stat> > Attributes;
+
+    // (name, attributes) of the entries of a directory
+    typedef boost::shared_ptr<const Attributes> Listing;
+
+    // aShared: false to only cache in-process what's set, e.g. values
+    // read from a lagging secondary (see FilesystemEntry::secondary)
+    Memcache(bool aShared = true);
 
     ~Memcache();
 
-    bool
+    Result
     get(const std::string& aPath, struct stat* aBuf);
 
+    // aTarget is the target of a symbolic link which is cached
+    // together with its attributes, empty for everything else
+    void
+    set(
+        const std::string& aPath,
+        struct stat* aBuf,
+        const std::string& aTarget = std::string());
+
+    // the target of the symbolic link aPath, false if it's not cached
+    bool
+    getTarget(const std::string& aPath, std::string& aTarget);
+
+    // sets many attributes at once (e.g. when listing a directory)
+    // the requests are buffered and sent together
+    void
+    set(const Attributes& aAttributes);
+
     void
-    set(const std::string& aPath, struct stat* aBuf);
+    setMissing(const std::string& aPath);
 
+    // removes the attributes of a changed path and
+    // invalidates the listing of its directory
     void
     remove(const std::string& aPath);
+
+    // same as remove but leaves the namespace index alone,
+    // e.g. because it's been updated already
+    void
+    invalidate(const std::string& aPath);
+
+    // invalidates many paths at once, e.g. a removed subtree
+    // the requests are buffered and sent together
+    void
+    invalidate(const std::vector<std::string>& aPaths);
+
+    // the current generation of the directory aDir, i.e. a value that
+    // changes whenever an entry of the directory changes.
+    // Empty if listings aren't cached.
+    std::string
+    generation(const std::string& aDir);
+
+    // the listing of aDir read at aGeneration, null if not cached
+    Listing
+    getListing(const std::string& aDir, const std::string& aGeneration);
+
+    void
+    setListing(
+        const std::string& aDir,
+        const std::string& aGeneration,
+        const Listing& aListing);
+
+  protected:
+    void
+    bumpGeneration(const std::string& aDir);
+
+    // reads the attributes (and the target of a symbolic link) from memcached
+    Result
+    fetch(const std::string& aPath, struct stat* aBuf, std::string& aTarget);
+
+    bool theShared;
+
+    // fills the in-process cache, UNKNOWN if the value isn't valid
+    static Result
+    decode(
+        const std::string& aPath,
+        const char* aValue,
+        size_t aLength,
+        struct stat* aBuf,
+        std::string& aTarget);
   };
 
 
@@ -96,6 +212,19 @@ namespace gridfs
 
     void
     createRootDir();
+
+    // falls back to list_by_regex if entries haven't been migrated
+    // to the parent field yet
+    void
+    checkParents();
+
+    // background threads, started once fuse runs (i.e. after
+    // daemonizing) and stopped before it exits
+    void
+    startThreads();
+
+    void
+    stopThreads();
     
     Fuse(); 
 
@@ -104,23 +233,64 @@ namespace gridfs
     const mongo::ConnectionString&
     connection_string();
 
-    memcached_st*
-    master() const { return theMaster; }
+    // chunk size to store a file with, given its length and
+    // the largest single write it was written with
+    unsigned int
+    chunkSize(const std::string& aPath, size_t aLength, size_t aMaxWrite) const;
 
-    memcached_pool_st*
-    pool() const { return theMemcachePool; }
+    // the memcached servers, see proc/instances
+    MemcacheRing*
+    ring() const { return theRing; }
 
-  protected:
-    friend class Memcache;
-    memcached_st*
-    cache();
+    AttributeCache*
+    attributes() const { return theAttributeCache; }
+
+    ListingCache*
+    listings() const { return theListingCache; }
+
+    // null if the namespace index isn't enabled
+    NamespaceIndex*
+    namespaceIndex() const { return theNamespaceIndex; }
+
+    // null before the threads are started
+    Unlinker*
+    unlinker() const { return theUnlinker; }
+
+    // null before the threads are started
+    Statistics*
+    statistics() const { return theStatistics; }
 
+    // the shared tier of the attribute cache
+    CacheBackend*
+    cache() const { return theCache; }
+
+    // null before the threads are started
+    IoExecutor*
+    io() const { return theIoExecutor; }
+
+    // null if all reads go to the primary
+    ReadRouter*
+    reads() const { return theReadRouter; }
+
+  protected:
     void
-    release(memcached_st*);
+    initChunkSizeRules();
+
+    // (fnmatch pattern, chunk size)
+    typedef std::pair<std::string, unsigned int> ChunkSizeRule;
+    std::vector<ChunkSizeRule> theChunkSizeRules;
 
-    memcached_pool_st*   theMemcachePool;
-    memcached_st*        theMaster;
+    MemcacheRing*        theRing;
     memcached_server_st* theServers;
+    AttributeCache*      theAttributeCache;
+    ListingCache*        theListingCache;
+    OplogTailer*         theOplogTailer;
+    NamespaceIndex*      theNamespaceIndex;
+    Unlinker*            theUnlinker;
+    Statistics*          theStatistics;
+    CacheBackend*        theCache;
+    IoExecutor*          theIoExecutor;
+    ReadRouter*          theReadRouter;
   };
 
   extern Fuse FUSE;
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "attribute_cache.h"
+
+#include <cstring>
+#include <sys/time.h>
+#include <boost/functional/hash.hpp>
+
+#include "lock.h"
+
+namespace gridfs {
+
+  AttributeCache::AttributeCache(size_t aMaxEntries, unsigned int aTTL)
+    : theMaxEntriesPerShard(aMaxEntries == 0 ? 0 : (aMaxEntries + NUM_SHARDS - 1) / NUM_SHARDS),
+      theTTL(aTTL)
+  {
+    for (size_t i = 0; i < NUM_SHARDS; ++i)
+      pthread_mutex_init(&theShards[i].theMutex, NULL);
+  }
+
+  AttributeCache::~AttributeCache()
+  {
+    for (size_t i = 0; i < NUM_SHARDS; ++i)
+      pthread_mutex_destroy(&theShards[i].theMutex);
+  }
+
+  bool
+  AttributeCache::get(const std::string& aPath, struct stat* aBuf, bool& aExists)
+  {
+    if (!enabled())
+      return false;
+
+    Shard& lShard = shard(aPath);
+    gridfs::Lock lLock(lShard.theMutex);
+
+    Entries::iterator lIt = lShard.theEntries.find(aPath);
+    if (lIt == lShard.theEntries.end())
+      return false;
+
+    if (lIt->second.theExpires < now())
+    {
+      lShard.theEntries.erase(lIt);
+      return false;
+    }
+
+    aExists = lIt->second.theExists;
+    if (aExists)
+      memcpy(aBuf, &lIt->second.theStat, sizeof(struct stat));
+    return true;
+  }
+
+  bool
+  AttributeCache::getTarget(const std::string& aPath, std::string& aTarget)
+  {
+    if (!enabled())
+      return false;
+
+    Shard& lShard = shard(aPath);
+    gridfs::Lock lLock(lShard.theMutex);
+
+    Entries::iterator lIt = lShard.theEntries.find(aPath);
+    if (lIt == lShard.theEntries.end()
+        || lIt->second.theTarget.empty()
+        || lIt->second.theExpires < now())
+      return false;
+
+    aTarget = lIt->second.theTarget;
+    return true;
+  }
+
+  void
+  AttributeCache::set(
+      const std::string& aPath,
+      const struct stat* aBuf,
+      const std::string& aTarget)
+  {
+    if (!enabled())
+      return;
+
+    Shard& lShard = shard(aPath);
+    gridfs::Lock lLock(lShard.theMutex);
+
+    Entry& lEntry = insert(lShard, aPath);
+    // attributes without a target (e.g. from a listing) keep the
+    // target of the same, unchanged symbolic link
+    bool lSameLink = aTarget.empty()
+      && lEntry.theExists
+      && S_ISLNK(aBuf->st_mode)
+      && S_ISLNK(lEntry.theStat.st_mode)
+      && aBuf->st_mtime == lEntry.theStat.st_mtime
+      && aBuf->st_size == (off_t)lEntry.theTarget.size();
+    if (!lSameLink)
+      lEntry.theTarget = aTarget;
+
+    memcpy(&lEntry.theStat, aBuf, sizeof(struct stat));
+    lEntry.theExists = true;
+  }
+
+  void
+  AttributeCache::setMissing(const std::string& aPath)
+  {
+    if (!enabled())
+      return;
+
+    Shard& lShard = shard(aPath);
+    gridfs::Lock lLock(lShard.theMutex);
+
+    Entry& lEntry = insert(lShard, aPath);
+    lEntry.theTarget.clear();
+    lEntry.theExists = false;
+  }
+
+  void
+  AttributeCache::remove(const std::string& aPath)
+  {
+    if (!enabled())
+      return;
+
+    Shard& lShard = shard(aPath);
+    gridfs::Lock lLock(lShard.theMutex);
+    lShard.theEntries.erase(aPath);
+  }
+
+  void
+  AttributeCache::clear()
+  {
+    for (size_t i = 0; i < NUM_SHARDS; ++i)
+    {
+      gridfs::Lock lLock(theShards[i].theMutex);
+      theShards[i].theEntries.clear();
+    }
+  }
+
+  AttributeCache::Shard&
+  AttributeCache::shard(const std::string& aPath)
+  {
+    return theShards[boost::hash<std::string>()(aPath) % NUM_SHARDS];
+  }
+
+  AttributeCache::Entry&
+  AttributeCache::insert(Shard& aShard, const std::string& aPath)
+  {
+    unsigned long long lNow = now();
+
+    if (aShard.theEntries.size() >= theMaxEntriesPerShard)
+      evict(aShard, lNow);
+
+    Entry& lEntry = aShard.theEntries[aPath];
+    lEntry.theExpires = lNow + theTTL;
+    return lEntry;
+  }
+
+  void
+  AttributeCache::evict(Shard& aShard, unsigned long long aNow)
+  {
+    // first drop everything that is expired anyway
+    Entries::iterator lIt = aShard.theEntries.begin();
+    while (lIt != aShard.theEntries.end())
+    {
+      if (lIt->second.theExpires < aNow)
+        lIt = aShard.theEntries.erase(lIt);
+      else
+        ++lIt;
+    }
+
+    // still full, make room by dropping an arbitrary entry
+    if (aShard.theEntries.size() >= theMaxEntriesPerShard)
+      aShard.theEntries.erase(aShard.theEntries.begin());
+  }
+
+  unsigned long long
+  AttributeCache::now()
+  {
+    struct timeval lNow;
+    gettimeofday(&lNow, NULL);
+    return (unsigned long long)lNow.tv_sec * 1000 + lNow.tv_usec / 1000;
+  }
+
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <string>
+#include <boost/unordered_map.hpp>
+
+namespace gridfs {
+
+  /**
+   * in-process cache of file attributes and symbolic link targets
+   * which is consulted before memcached.
+   *
+   * The entries expire after a short time (attr_cache_ttl) because other
+   * mounts sharing the same database might change them. The map is split
+   * into shards with a mutex each such that the fuse threads don't
+   * contend on a single lock.
+   */
+  class AttributeCache
+  {
+    public:
+      AttributeCache(size_t aMaxEntries, unsigned int aTTL);
+
+      ~AttributeCache();
+
+      // returns false if nothing is cached for the path, otherwise
+      // aExists tells whether the path exists and aBuf is set if it does
+      bool
+      get(const std::string& aPath, struct stat* aBuf, bool& aExists);
+
+      // aTarget is the target of a symbolic link, empty otherwise
+      void
+      set(
+          const std::string& aPath,
+          const struct stat* aBuf,
+          const std::string& aTarget = std::string());
+
+      // returns false if no target is cached for the path
+      bool
+      getTarget(const std::string& aPath, std::string& aTarget);
+
+      // remember that the path doesn't exist
+      void
+      setMissing(const std::string& aPath);
+
+      void
+      remove(const std::string& aPath);
+
+      void
+      clear();
+
+      bool
+      enabled() const { return theMaxEntriesPerShard != 0; }
+
+    private:
+      struct Entry
+      {
+        struct stat theStat;
+        std::string theTarget;
+        unsigned long long theExpires;
+        bool theExists;
+      };
+
+      typedef boost::unordered_map<std::string, Entry> Entries;
+
+      struct Shard
+      {
+        pthread_mutex_t theMutex;
+        Entries theEntries;
+      };
+
+      static const size_t NUM_SHARDS = 64;
+
+      Shard&
+      shard(const std::string& aPath);
+
+      void
+      evict(Shard& aShard, unsigned long long aNow);
+
+      Entry&
+      insert(Shard& aShard, const std::string& aPath);
+
+      // milliseconds
+      static unsigned long long
+      now();
+
+      // forbid copying
+      AttributeCache(const AttributeCache&);
+      AttributeCache& operator=(const AttributeCache&);
+
+      Shard        theShards[NUM_SHARDS];
+      size_t       theMaxEntriesPerShard;
+      unsigned int theTTL;
+  };
+
+}
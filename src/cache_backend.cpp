@@ -0,0 +1,304 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "cache_backend.h"
+
+#include <cstdlib>
+#include <sstream>
+#include <sys/time.h>
+
+#include "gridfs_fuse.h"
+#include "memcached_backend.h"
+#include "lock.h"
+
+namespace gridfs {
+
+  // milliseconds
+  static unsigned long long
+  now()
+  {
+    struct timeval lNow;
+    gettimeofday(&lNow, NULL);
+    return (unsigned long long)lNow.tv_sec * 1000 + lNow.tv_usec / 1000;
+  }
+
+  CacheBackend*
+  CacheBackend::create(const std::string& aName)
+  {
+    if (aName == "memcached")
+      return new MemcachedCacheBackend();
+    if (aName == "local")
+      return new LocalCacheBackend(
+          (size_t)FUSE.config.local_cache_mb << 20,
+          FUSE.config.local_cache_ttl * 1000);
+    if (aName == "tiered")
+      // values changed by other mounts are only seen once they expire
+      return new TieredCacheBackend(
+          new LocalCacheBackend(
+              (size_t)FUSE.config.local_cache_mb << 20,
+              FUSE.config.attr_cache_ttl),
+          new MemcachedCacheBackend());
+    if (aName == "none")
+      return new NoCacheBackend();
+    return 0;
+  }
+
+  void
+  CacheBackend::get(const std::vector<std::string>& aKeys, std::vector<std::string>& aValues)
+  {
+    aValues.resize(aKeys.size());
+    for (size_t i = 0; i < aKeys.size(); ++i)
+      if (!get(aKeys[i], aValues[i]))
+        aValues[i].clear();
+  }
+
+  // bookkeeping of the map per entry besides key and value
+  static const size_t ENTRY_OVERHEAD = 64;
+
+  // milliseconds between two sweeps of expired entries
+  static const unsigned long long SWEEP_INTERVAL = 1000;
+
+  static size_t
+  entry_size(const std::string& aKey, const std::string& aValue)
+  {
+    return aKey.size() + aValue.size() + ENTRY_OVERHEAD;
+  }
+
+  LocalCacheBackend::LocalCacheBackend(size_t aMaxBytes, unsigned int aMaxAge)
+    : theMaxBytes(aMaxBytes),
+      theMaxAge(aMaxAge),
+      theBytes(0),
+      theLastSweep(0)
+  {
+    pthread_mutex_init(&theMutex, NULL);
+  }
+
+  LocalCacheBackend::~LocalCacheBackend()
+  {
+    pthread_mutex_destroy(&theMutex);
+  }
+
+  bool
+  LocalCacheBackend::get(const std::string& aKey, std::string& aValue)
+  {
+    gridfs::Lock lLock(theMutex);
+
+    Entries::iterator lIt = theEntries.find(aKey);
+    if (lIt == theEntries.end())
+      return false;
+
+    if (lIt->second.theExpires && lIt->second.theExpires < now())
+    {
+      erase(lIt);
+      return false;
+    }
+
+    aValue = lIt->second.theValue;
+    return true;
+  }
+
+  void
+  LocalCacheBackend::set(const std::string& aKey, const std::string& aValue, time_t aTTL)
+  {
+    gridfs::Lock lLock(theMutex);
+    insert(aKey, aValue, aTTL);
+  }
+
+  void
+  LocalCacheBackend::add(const std::string& aKey, const std::string& aValue, time_t aTTL)
+  {
+    gridfs::Lock lLock(theMutex);
+
+    Entries::iterator lIt = theEntries.find(aKey);
+    if (lIt != theEntries.end() &&
+        (lIt->second.theExpires == 0 || lIt->second.theExpires >= now()))
+      return;
+
+    insert(aKey, aValue, aTTL);
+  }
+
+  void
+  LocalCacheBackend::remove(const std::string& aKey)
+  {
+    gridfs::Lock lLock(theMutex);
+
+    Entries::iterator lIt = theEntries.find(aKey);
+    if (lIt != theEntries.end())
+      erase(lIt);
+  }
+
+  void
+  LocalCacheBackend::increment(const std::string& aKey)
+  {
+    gridfs::Lock lLock(theMutex);
+
+    Entries::iterator lIt = theEntries.find(aKey);
+    if (lIt == theEntries.end())
+      return;
+
+    std::ostringstream lValue;
+    lValue << strtoull(lIt->second.theValue.c_str(), NULL, 10) + 1;
+    theBytes -= lIt->second.theValue.size();
+    lIt->second.theValue = lValue.str();
+    theBytes += lIt->second.theValue.size();
+  }
+
+  void
+  LocalCacheBackend::insert(const std::string& aKey, const std::string& aValue, time_t aTTL)
+  {
+    size_t lSize = entry_size(aKey, aValue);
+    if (lSize > theMaxBytes)
+      return;
+
+    Entries::iterator lIt = theEntries.find(aKey);
+    if (lIt != theEntries.end())
+      erase(lIt);
+
+    // make room, preferably by dropping expired entries
+    if (theBytes + lSize > theMaxBytes)
+      sweep();
+    while (theBytes + lSize > theMaxBytes && !theEntries.empty())
+      erase(theEntries.begin());
+
+    unsigned long long lAge = (unsigned long long)aTTL * 1000;
+    if (theMaxAge && (lAge == 0 || lAge > theMaxAge))
+      lAge = theMaxAge;
+
+    Entry& lEntry = theEntries[aKey];
+    lEntry.theValue = aValue;
+    lEntry.theExpires = lAge ? now() + lAge : 0;
+    theBytes += lSize;
+  }
+
+  void
+  LocalCacheBackend::erase(Entries::iterator aIt)
+  {
+    theBytes -= entry_size(aIt->first, aIt->second.theValue);
+    theEntries.erase(aIt);
+  }
+
+  void
+  LocalCacheBackend::sweep()
+  {
+    // a full store without expired entries would be walked on every insert
+    unsigned long long lNow = now();
+    if (lNow < theLastSweep + SWEEP_INTERVAL)
+      return;
+    theLastSweep = lNow;
+
+    Entries::iterator lIt = theEntries.begin();
+    while (lIt != theEntries.end())
+    {
+      if (lIt->second.theExpires && lIt->second.theExpires < lNow)
+      {
+        theBytes -= entry_size(lIt->first, lIt->second.theValue);
+        lIt = theEntries.erase(lIt);
+      }
+      else
+        ++lIt;
+    }
+  }
+
+  // bytes of generations kept by NoCacheBackend, a directory whose
+  // generation is dropped just gets a new one (see Memcache::generation)
+  static const size_t GENERATIONS_SIZE = 4 << 20;
+
+  static bool
+  is_generation(const std::string& aKey)
+  {
+    return aKey.compare(0, 2, "g:") == 0;
+  }
+
+  NoCacheBackend::NoCacheBackend()
+    : theGenerations(GENERATIONS_SIZE, 0)
+  {
+  }
+
+  bool
+  NoCacheBackend::get(const std::string& aKey, std::string& aValue)
+  {
+    return is_generation(aKey) && theGenerations.get(aKey, aValue);
+  }
+
+  void
+  NoCacheBackend::set(const std::string& aKey, const std::string& aValue, time_t aTTL)
+  {
+    if (is_generation(aKey))
+      theGenerations.set(aKey, aValue, aTTL);
+  }
+
+  void
+  NoCacheBackend::add(const std::string& aKey, const std::string& aValue, time_t aTTL)
+  {
+    if (is_generation(aKey))
+      theGenerations.add(aKey, aValue, aTTL);
+  }
+
+  void
+  NoCacheBackend::remove(const std::string& aKey)
+  {
+    if (is_generation(aKey))
+      theGenerations.remove(aKey);
+  }
+
+  void
+  NoCacheBackend::increment(const std::string& aKey)
+  {
+    if (is_generation(aKey))
+      theGenerations.increment(aKey);
+  }
+
+  TieredCacheBackend::TieredCacheBackend(CacheBackend* aLocal, CacheBackend* aShared)
+    : theLocal(aLocal),
+      theShared(aShared)
+  {}
+
+  TieredCacheBackend::~TieredCacheBackend()
+  {
+    delete theLocal;
+    delete theShared;
+  }
+
+  bool
+  TieredCacheBackend::get(const std::string& aKey, std::string& aValue)
+  {
+    if (theLocal->get(aKey, aValue))
+      return true;
+
+    if (!theShared->get(aKey, aValue))
+      return false;
+
+    theLocal->set(aKey, aValue, 0);
+    return true;
+  }
+
+  void
+  TieredCacheBackend::set(const std::string& aKey, const std::string& aValue, time_t aTTL)
+  {
+    theLocal->set(aKey, aValue, aTTL);
+    theShared->set(aKey, aValue, aTTL);
+  }
+
+  void
+  TieredCacheBackend::add(const std::string& aKey, const std::string& aValue, time_t aTTL)
+  {
+    // the shared value wins, it's read again anyway
+    theShared->add(aKey, aValue, aTTL);
+  }
+
+  void
+  TieredCacheBackend::remove(const std::string& aKey)
+  {
+    theLocal->remove(aKey);
+    theShared->remove(aKey);
+  }
+
+  void
+  TieredCacheBackend::increment(const std::string& aKey)
+  {
+    // read again from the shared tier once the increment arrived
+    theLocal->remove(aKey);
+    theShared->increment(aKey);
+  }
+
+}
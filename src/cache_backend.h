@@ -0,0 +1,207 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <boost/unordered_map.hpp>
+
+namespace gridfs {
+
+  /**
+   * the shared tier of the attribute and listing cache behind the
+   * in-process caches, i.e. a store of encoded values (see Memcache and
+   * memcache_value.h). The backend is chosen with -o cache:
+   *
+   *   memcached  memcached servers shared by all mounts (the default)
+   *   local      values are kept in this process only, e.g. for a
+   *              single mount
+   *   tiered     local in front of memcached
+   *   none       nothing is cached besides the in-process caches
+   *              and the generations they depend on
+   */
+  class CacheBackend
+  {
+    public:
+      // null for an unknown name
+      static CacheBackend*
+      create(const std::string& aName);
+
+      virtual
+      ~CacheBackend() {}
+
+      // background threads, see Fuse::startThreads
+      virtual void
+      start() {}
+
+      virtual void
+      stop() {}
+
+      // false if aKey isn't cached
+      virtual bool
+      get(const std::string& aKey, std::string& aValue) = 0;
+
+      // aValues[i] is the value of aKeys[i], empty if it isn't cached
+      virtual void
+      get(const std::vector<std::string>& aKeys, std::vector<std::string>& aValues);
+
+      // aTTL in seconds, 0 for no expiration
+      virtual void
+      set(const std::string& aKey, const std::string& aValue, time_t aTTL) = 0;
+
+      // only sets aKey if it doesn't exist yet
+      virtual void
+      add(const std::string& aKey, const std::string& aValue, time_t aTTL) = 0;
+
+      virtual void
+      remove(const std::string& aKey) = 0;
+
+      // increments a decimal value, nothing if it doesn't exist
+      virtual void
+      increment(const std::string& aKey) = 0;
+
+      // an invalidation of aKey hasn't reached the backend yet,
+      // i.e. get might still return what's about to be removed
+      virtual bool
+      pending(const std::string& aKey) { return false; }
+  };
+
+  /**
+   * values kept in this process, at most aMaxBytes of keys and values.
+   * Once it's full, expired entries are dropped first, otherwise
+   * arbitrary ones. aMaxAge bounds how long values that are never read
+   * again are kept, e.g. the listings of outdated generations (see
+   * Memcache::bumpGeneration), and how long changes of other mounts go
+   * unnoticed without oplog_tail.
+   */
+  class LocalCacheBackend : public CacheBackend
+  {
+    public:
+      // aMaxAge in milliseconds, 0 for no limit besides the TTL
+      LocalCacheBackend(size_t aMaxBytes, unsigned int aMaxAge);
+
+      ~LocalCacheBackend();
+
+      virtual bool
+      get(const std::string& aKey, std::string& aValue);
+
+      virtual void
+      set(const std::string& aKey, const std::string& aValue, time_t aTTL);
+
+      virtual void
+      add(const std::string& aKey, const std::string& aValue, time_t aTTL);
+
+      virtual void
+      remove(const std::string& aKey);
+
+      virtual void
+      increment(const std::string& aKey);
+
+    private:
+      struct Entry
+      {
+        std::string theValue;
+        // milliseconds, 0 if it doesn't expire
+        unsigned long long theExpires;
+      };
+
+      typedef boost::unordered_map<std::string, Entry> Entries;
+
+      void
+      insert(const std::string& aKey, const std::string& aValue, time_t aTTL);
+
+      void
+      erase(Entries::iterator aIt);
+
+      // drops all expired entries, at most once per second
+      void
+      sweep();
+
+      // forbid copying
+      LocalCacheBackend(const LocalCacheBackend&);
+      LocalCacheBackend& operator=(const LocalCacheBackend&);
+
+      size_t          theMaxBytes;
+      unsigned int    theMaxAge;
+      // keys and values of all entries (see entry_size)
+      size_t          theBytes;
+      // milliseconds
+      unsigned long long theLastSweep;
+      pthread_mutex_t theMutex;
+      Entries         theEntries;
+  };
+
+  /**
+   * caches nothing but the generations of directories, which the
+   * in-process listing cache is keyed by (see Memcache::generation)
+   */
+  class NoCacheBackend : public CacheBackend
+  {
+    public:
+      NoCacheBackend();
+
+      virtual bool
+      get(const std::string& aKey, std::string& aValue);
+
+      virtual void
+      set(const std::string& aKey, const std::string& aValue, time_t aTTL);
+
+      virtual void
+      add(const std::string& aKey, const std::string& aValue, time_t aTTL);
+
+      virtual void
+      remove(const std::string& aKey);
+
+      virtual void
+      increment(const std::string& aKey);
+
+    private:
+      LocalCacheBackend theGenerations;
+  };
+
+  // a local backend in front of another one, e.g. memcached
+  class TieredCacheBackend : public CacheBackend
+  {
+    public:
+      // takes ownership of both
+      TieredCacheBackend(CacheBackend* aLocal, CacheBackend* aShared);
+
+      ~TieredCacheBackend();
+
+      virtual void
+      start() { theShared->start(); }
+
+      virtual void
+      stop() { theShared->stop(); }
+
+      virtual bool
+      get(const std::string& aKey, std::string& aValue);
+
+      virtual void
+      set(const std::string& aKey, const std::string& aValue, time_t aTTL);
+
+      virtual void
+      add(const std::string& aKey, const std::string& aValue, time_t aTTL);
+
+      virtual void
+      remove(const std::string& aKey);
+
+      virtual void
+      increment(const std::string& aKey);
+
+      virtual bool
+      pending(const std::string& aKey) { return theShared->pending(aKey); }
+
+    private:
+      // forbid copying
+      TieredCacheBackend(const TieredCacheBackend&);
+      TieredCacheBackend& operator=(const TieredCacheBackend&);
+
+      CacheBackend* theLocal;
+      CacheBackend* theShared;
+  };
+
+}
@@ -1,86 +1,281 @@
 #include "gridfs_fuse.h"
 
 #include "directory.h"
+#include "namespace_index.h"
 
+#include <algorithm>
 #include <sstream>
-#include <set>
+#include <syslog.h>
 
 namespace gridfs {
 
   void
-  Directory::list(void* buf, fuse_fill_dir_t filler)
+  Directory::list(void* buf, fuse_fill_dir_t filler, off_t aOffset)
   {
-    // get all entries
-    std::auto_ptr<mongo::DBClientCursor> lFileEntries(list());
+    // offset 0 starts a new listing (or rewinddir) and the offset of
+    // the last filled entry continues it, everything else is a seekdir
+    if (aOffset == 0)
+      restart();
+    else if (aOffset != theOffset)
+      seek(aOffset);
 
+    // default fileentries
+    if (theOffset == 0)
+    {
+      if (filler(buf, ".", NULL, 1))
+        return;
+      theOffset = 1;
+    }
+    if (theOffset == 1)
+    {
+      if (filler(buf, "..", NULL, 2))
+        return;
+      theOffset = 2;
+    }
+
+    if (theListing)
+      listCached(buf, filler);
+    else
+      listEntries(buf, filler);
+  }
+
+  void
+  Directory::listCached(void* buf, fuse_fill_dir_t filler)
+  {
+    const Memcache::Attributes& lEntries = *theListing;
+    for (size_t i = theOffset - 2; i < lEntries.size(); ++i)
+    {
+      if (filler(buf, lEntries[i].first.c_str(), &lEntries[i].second, theOffset + 1))
+        break;
+      ++theOffset;
+    }
+  }
+
+  void
+  Directory::listEntries(void* buf, fuse_fill_dir_t filler)
+  {
     // +1 because of the path will have a trailing /
     size_t filename_pos = path().length() + 1;
-    std::set<std::string> lEntries;
 
-    // default fileentries
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    Memcache::Attributes lAttributes;
 
-    // eliminate duplicates
-    while (lFileEntries->more())
+    bool lComplete = true;
+    mongo::BSONObj lFile;
+    while (next(lFile))
     {
-      std::string lFilePath = lFileEntries->next().getStringField("filename");
-      const std::pair<std::set<std::string>::iterator, bool>& lRes =
-        lEntries.insert(lFilePath);
+      const char* lFilePath = lFile.getStringField("filename");
+
+      struct stat lStat;
+      FilesystemEntry::stat(lFile, &lStat);
 
-      if (lRes.second) // no dup
+      if (filler(buf, lFilePath + filename_pos, &lStat, theOffset + 1))
       {
-        std::string lFileName = (*lRes.first).substr(filename_pos);
-        filler(buf, lFileName.c_str(), NULL, 0);
+        // buffer is full, it's the first one of the next call
+        thePending = lFile.getOwned();
+        lComplete = false;
+        break;
       }
+      ++theOffset;
+
+      lAttributes.push_back(std::make_pair(std::string(lFilePath), lStat));
+
+      // huge directories aren't cached
+      if (theCollected.get())
+      {
+        if (theCollected->size() < FUSE.config.listing_cache_max_entries)
+          theCollected->push_back(std::make_pair(std::string(lFilePath + filename_pos), lStat));
+        else
+          theCollected.reset();
+      }
+    }
+
+    // the getattr calls following a listing (e.g. ls -l)
+    // are answered from the cache
+    Memcache m(!secondary());
+    m.set(lAttributes);
+
+    // cached for the generation read before the query, i.e. it's
+    // never used if the directory changed in the meantime
+    if (lComplete && theCollected.get())
+    {
+      Memcache::Listing lListing(theCollected.release());
+      m.setListing(path(), theGeneration, lListing);
     }
   }
 
-  bool
-  Directory::isEmpty()
+  void
+  Directory::restart()
   {
-    std::auto_ptr<mongo::DBClientCursor> lFileEntries(list());
-    return !lFileEntries->more();
+    close();
+    theComplete = false;
+    theLastName.clear();
+    thePending = mongo::BSONObj();
+    theOffset = 0;
+    theCollected.reset();
+
+    NamespaceIndex* lIndex = FUSE.namespaceIndex();
+    if (lIndex)
+    {
+      theListing = lIndex->list(path());
+      if (theListing)
+        return;
+    }
+
+    Memcache m;
+    theGeneration = m.generation(path());
+    theListing = m.getListing(path(), theGeneration);
+    theCollected.reset(
+        !theListing && !theGeneration.empty() ? new Memcache::Attributes() : 0);
   }
- 
-  mongo::DBClientCursor*
-  Directory::list()
+
+  void
+  Directory::seek(off_t aOffset)
   {
-    // filter by regular expression form dir path to the next /
-    const std::string lRegex = "^" + pathregex() + "/[^/]*$";
-    mongo::BSONObj lQuery = BSON("filename" << BSON("$regex" << lRegex));
+    if (theListing)
+    {
+      theOffset = std::min(aOffset, (off_t)theListing->size() + 2);
+      return;
+    }
+
+    // a listing that didn't start at the beginning isn't cached
+    theCollected.reset();
 
-    return gridfs().list(lQuery).release();
+    close();
+    theComplete = false;
+    theLastName.clear();
+    thePending = mongo::BSONObj();
+    theOffset = 0;
+
+    // the offsets are positions in filename order, i.e. the entries
+    // before aOffset have to be read again
+    mongo::BSONObj lFile;
+    while (theOffset < aOffset && (theOffset < 2 || next(lFile)))
+      ++theOffset;
   }
-  
-  const std::string
-  Directory::pathregex()
+
+  bool
+  Directory::next(mongo::BSONObj& aFile)
   {
-    // we have to escape all special characters (e.g. '.' -> '\\.') from the path
-    int len = path().length();
-    std::stringstream regex;
-    for (int i = 0; i < len; i++) {
-      char ch = path().at(i);
-      switch(ch)
+    if (!thePending.isEmpty())
+    {
+      aFile = thePending;
+      thePending = mongo::BSONObj();
+      return true;
+    }
+
+    if (theComplete)
+      return false;
+
+    if (!theEntries.get())
+      open();
+
+    bool lReopened = false;
+    for (;;)
+    {
+      try
       {
-        case '.':
-        case '^':
-        case '$':
-        case '|':
-        case '(':
-        case ')':
-        case '[':
-        case ']':
-        case '*':
-        case '+':
-        case '?':
-        case '\\':
-          regex << '\\' << ch; break;
-        default:
-          regex << ch; break;
+        if (!theEntries->more())
+        {
+          close();
+          theComplete = true;
+          return false;
+        }
+        aFile = theEntries->next();
       }
+      catch (mongo::UserException& e)
+      {
+        // e.g. the cursor timed out on the server between two calls,
+        // continue after the last entry once
+        if (lReopened)
+          throw;
+        syslog(LOG_INFO, "list: reopening cursor of %s: %s",
+            path().c_str(), e.what());
+        open();
+        lReopened = true;
+        continue;
+      }
+
+      // the versions of an entry are sorted by upload date,
+      // i.e. the first one is the latest
+      const char* lFilePath = aFile.getStringField("filename");
+      if (theLastName == lFilePath)
+        continue;
+
+      theLastName = lFilePath;
+      return true;
+    }
+  }
+
+  void
+  Directory::open()
+  {
+    mongo::Query lQuery(childrenQuery(theLastName));
+    lQuery.sort(BSON("filename" << 1 << "uploadDate" << -1));
+    int lOptions = route(lQuery);
+
+    close();
+    theCursorConnection.reset(
+        new mongo::ScopedDbConnection(FUSE.connection_string()));
+    theEntries = theCursorConnection->conn().query(
+        filesCollection(),
+        lQuery,
+        0 /* all */,
+        0 /* no skip */,
+        &statFields(),
+        lOptions,
+        FUSE.config.readdir_batch_size);
+  }
+
+  void
+  Directory::close()
+  {
+    // the cursor uses the connection when it's destroyed
+    theEntries.reset();
+    if (theCursorConnection.get())
+    {
+      theCursorConnection->done();
+      theCursorConnection.reset();
+    }
+  }
+
+  bool
+  Directory::isEmpty()
+  {
+    bool lEmpty;
+    NamespaceIndex* lIndex = FUSE.namespaceIndex();
+    if (lIndex && lIndex->isEmpty(path(), lEmpty))
+      return lEmpty;
+
+    // a single index lookup for any child, on the primary
+    // because rmdir depends on it
+    static const mongo::BSONObj lFields = BSON("_id" << 1);
+    return connection()->findOne(
+        filesCollection(),
+        childrenQuery(""),
+        &lFields).isEmpty();
+  }
+ 
+  mongo::BSONObj
+  Directory::childrenQuery(const std::string& aAfter)
+  {
+    mongo::BSONObjBuilder lQuery;
+
+    if (!FUSE.config.list_by_regex)
+    {
+      lQuery << "parent" << path();
+      if (!aAfter.empty())
+        lQuery << "filename" << BSON("$gt" << aAfter);
+    }
+    else
+    {
+      // filter by regular expression form dir path to the next /
+      const std::string lRegex = "^" + pathregex() + "/[^/]*$";
+      if (aAfter.empty())
+        lQuery << "filename" << BSON("$regex" << lRegex);
+      else
+        lQuery << "filename" << BSON("$regex" << lRegex << "$gt" << aAfter);
     }
-    return regex.str();
+    return lQuery.obj();
   }
 
 }
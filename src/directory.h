@@ -10,22 +10,82 @@ namespace gridfs {
   class Directory : public FilesystemEntry
   {
     public:
-      Directory(const std::string& aPath) : FilesystemEntry(aPath){};     
+      Directory(const std::string& aPath)
+        : FilesystemEntry(aPath),
+          theComplete(false),
+          theOffset(0)
+      {}
+
+      ~Directory() { close(); }
  
+      // fills the entries from aOffset on until the buffer is full,
+      // the cursor is kept open for the following call
       void 
-      list(void* buf, fuse_fill_dir_t filler);
+      list(void* buf, fuse_fill_dir_t filler, off_t aOffset);
   
       bool
       isEmpty();
 
     private:
 
-      const std::string
-      pathregex();
+      // the files documents of all entries in this directory whose
+      // name is greater than aAfter, selected by the indexed parent
+      // field or list_by_regex
+      mongo::BSONObj
+      childrenQuery(const std::string& aAfter);
+
+      void
+      listCached(void* buf, fuse_fill_dir_t filler);
+
+      void
+      listEntries(void* buf, fuse_fill_dir_t filler);
+
+      // starts a new listing, from the cache if possible
+      void
+      restart();
+
+      // (re)opens the cursor after the last returned entry
+      void
+      open();
+
+      // kills the cursor if it's still open and returns its connection
+      void
+      close();
+
+      // restarts the listing and skips to aOffset
+      void
+      seek(off_t aOffset);
+
+      // the latest version of the next entry
+      bool
+      next(mongo::BSONObj& aFile);
+
+    private:
+      // the cursor is kept between calls which might run on different
+      // threads, i.e. it needs a connection of its own
+      std::auto_ptr<mongo::ScopedDbConnection> theCursorConnection;
+      std::auto_ptr<mongo::DBClientCursor> theEntries;
+
+      // the cursor was exhausted and has been closed
+      bool theComplete;
+
+      // offset of the next entry to be filled
+      off_t theOffset;
+
+      // filename of the last entry returned by next
+      std::string theLastName;
 
-      mongo::DBClientCursor*
-      list();
+      // returned by next but didn't fit into the buffer
+      mongo::BSONObj thePending;
+
+      // generation of the directory when the listing was started
+      std::string theGeneration;
+
+      // the cached listing if there is one
+      Memcache::Listing theListing;
+
+      // the entries read so far if the listing is going to be cached
+      std::auto_ptr<Memcache::Attributes> theCollected;
   }; 
 
 }
-
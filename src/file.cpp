@@ -1,25 +1,157 @@
 #include "file.h"
 
+#include <map>
 #include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <climits>
+#include <cstring>
 #include <sys/mman.h>
 #include <syslog.h>
 #include <cassert>
+#include <boost/functional/hash.hpp>
 
 #include "gridfs_fuse.h"
+#include "io_executor.h"
+#include "read_router.h"
 
 #include "lock.h"
 
 namespace gridfs {
 
+  /**
+   * fetches a chunk of a file. Requests for other chunks of the same
+   * file queued right after it are fetched with the same query.
+   *
+   * Only chunks which aren't holes are requested (see File::read_ahead),
+   * i.e. a missing one fails the request and the reader asks mongo
+   * itself, e.g. if a secondary hasn't replicated it yet.
+   */
+  class ChunkRequest : public IoRequest
+  {
+    public:
+      // aPrimary: the file has been changed through the same handle
+      ChunkRequest(const std::string& aPath, bool aPrimary, const mongo::BSONElement& aFileId, int aChunkN)
+        : thePath(aPath),
+          thePrimary(aPrimary),
+          theChunkN(aChunkN)
+      {
+        mongo::BSONObjBuilder lFileId;
+        lFileId.appendAs(aFileId, "files_id");
+        theFileId = lFileId.obj();
+      }
+
+      // empty if the chunk doesn't exist
+      const mongo::BSONObj&
+      chunk() const { return theChunk; }
+
+    protected:
+      virtual void
+      run(MongoContext& aContext)
+      {
+        if (theMerged.empty())
+        {
+          mongo::BSONObjBuilder lQueryObj;
+          lQueryObj.appendElements(theFileId);
+          lQueryObj.append("n", theChunkN);
+          mongo::Query lQuery(lQueryObj.obj());
+          int lOptions = route(lQuery);
+          theChunk = aContext.connection().findOne(aContext.chunksCollection(), lQuery, 0, lOptions);
+          if (theChunk.isEmpty())
+            throw std::runtime_error(missing(theChunkN));
+          return;
+        }
+
+        // several open handles of a file might ask for the same chunk
+        typedef std::multimap<int, ChunkRequest*> Requests;
+        Requests lRequests;
+        lRequests.insert(std::make_pair(theChunkN, this));
+        mongo::BSONArrayBuilder lChunkNs;
+        lChunkNs.append(theChunkN);
+        for (std::vector<ChunkRequest*>::const_iterator lIt = theMerged.begin();
+             lIt != theMerged.end();
+             ++lIt)
+        {
+          if (lRequests.find((*lIt)->theChunkN) == lRequests.end())
+            lChunkNs.append((*lIt)->theChunkN);
+          lRequests.insert(std::make_pair((*lIt)->theChunkN, *lIt));
+        }
+
+        mongo::BSONObjBuilder lQueryObj;
+        lQueryObj.appendElements(theFileId);
+        lQueryObj.append("n", BSON("$in" << lChunkNs.arr()));
+        mongo::Query lQuery(lQueryObj.obj());
+        int lOptions = route(lQuery);
+
+        std::auto_ptr<mongo::DBClientCursor> lCursor =
+          aContext.connection().query(aContext.chunksCollection(), lQuery, 0, 0, 0, lOptions);
+        while (lCursor->more())
+        {
+          mongo::BSONObj lChunk = lCursor->next().getOwned();
+          std::pair<Requests::iterator, Requests::iterator> lRange =
+            lRequests.equal_range(lChunk["n"].numberInt());
+          for (Requests::iterator lIt = lRange.first; lIt != lRange.second; ++lIt)
+            lIt->second->theChunk = lChunk;
+        }
+
+        // all of them fail together (see IoExecutor::run)
+        for (Requests::const_iterator lIt = lRequests.begin(); lIt != lRequests.end(); ++lIt)
+          if (lIt->second->theChunk.isEmpty())
+            throw std::runtime_error(missing(lIt->first));
+      }
+
+      virtual bool
+      merge(IoRequest& aOther)
+      {
+        ChunkRequest* lOther = dynamic_cast<ChunkRequest*>(&aOther);
+        if (!lOther || lOther->thePrimary != thePrimary ||
+            !lOther->theFileId.binaryEqual(theFileId))
+          return false;
+
+        theMerged.push_back(lOther);
+        return true;
+      }
+
+    private:
+      std::string
+      missing(int aChunkN) const
+      {
+        std::ostringstream lMessage;
+        lMessage << "chunk " << aChunkN << " of " << thePath << " not found";
+        return lMessage.str();
+      }
+
+      // see FilesystemEntry::route
+      int
+      route(mongo::Query& aQuery)
+      {
+        ReadRouter* lRouter = FUSE.reads();
+        if (!lRouter || thePrimary)
+          return 0;
+        return lRouter->route(aQuery, thePath);
+      }
+
+      std::string    thePath;
+      bool           thePrimary;
+      mongo::BSONObj theFileId;
+      int            theChunkN;
+      mongo::BSONObj theChunk;
+
+      // kept alive by the executor until they are completed
+      std::vector<ChunkRequest*> theMerged;
+  };
+
   File::File(const std::string& aPath):
     FilesystemEntry(aPath),
     theFileLength(0),
     theChunkSize(0),
     theWritten(0),
+    theMaxWrite(0),
     theCurrentDataSize(0),
     theData(0),
     theHasChanges(false),
     theCachedChunkN(-1),
+    theCachedChunkIsHole(false),
     theCachedChunk(mongo::BSONObj())
   {
     pthread_mutex_init(&mutex_read, NULL);
@@ -40,7 +172,10 @@ namespace gridfs {
 
     // disallow appending to a file
     // appending doesn't fit to the mongo gridfs modell
-    if(theWritten != (size_t)offset){
+    // however, seeking forward in an empty file is fine because the
+    // skipped range is zero-filled virtual memory (see storeFile)
+    if(theWritten > (size_t)offset ||
+       (theWritten < (size_t)offset && file(STAT_FIELDS)["length"].numberLong() != 0)){
       std::stringstream lMsg;
       lMsg << "Appending to a file other than to the beginning of it is not allowed. "
            << "\n    Mongo's Gridfs doesn't allow appending either. "
@@ -58,12 +193,12 @@ namespace gridfs {
       init_memory();
     }
 
-    while(theCurrentDataSize < (offset + size))
+    if(theCurrentDataSize < (offset + size))
     {
       syslog(LOG_DEBUG,
           "requesting extra virtual memory. size %i offset %i chunksize %i",
           (int) size, (int) offset, (int) theChunkSize);
-      extend_memory();
+      extend_memory(offset + size);
     }
       
     memcpy( 
@@ -71,14 +206,20 @@ namespace gridfs {
       data /* source mem pointer */, 
       size);
     theHasChanges = true;
-    theWritten += size;
+    theWritten = offset + size;
+    theMaxWrite = std::max(theMaxWrite, size);
     return size;
   }
 
   void 
   File::store()
   {
-    gridfs().storeFile((const char*)theData, theWritten, path(), gridfile().getContentType());
+    // the new version keeps the attributes but is modified now
+    Metadata lMetadata(file(STAT_FIELDS), FUSE.config.default_uid, FUSE.config.default_gid);
+    lMetadata.mtime = lMetadata.ctime = Metadata::now();
+
+    storeFile((const char*)theData, theWritten, lMetadata.toBSON(userMetadata(file(STAT_FIELDS))),
+        FUSE.chunkSize(path(), theWritten, theMaxWrite));
     free_memory(); // clean dirty flag and release virtual memory
     theFileLength = theWritten;
     
@@ -89,10 +230,31 @@ namespace gridfs {
   File::read(char *data, size_t size, off_t offset)
   {
     if (theChunkSize == 0)
-      theChunkSize = gridfile().getChunkSize();
+    {
+      theChunkSize = file()["chunkSize"].numberInt();
+      init_holes();
+    }
 
     if (theFileLength == 0)
-      theFileLength = gridfile().getContentLength();
+      theFileLength = file()["length"].numberLong();
+
+    // small files might be stored inline in the files document
+    // which has already been fetched
+    mongo::BSONElement lInlineData = file()["data"];
+    if (lInlineData.type() == mongo::BinData)
+    {
+      int lLength;
+      const char* lData = lInlineData.binData(lLength);
+
+      // the data might be longer than the file, e.g. after truncate
+      size_t lFileLength = std::min((size_t)lLength, theFileLength);
+      if (lFileLength <= (size_t)offset)
+        return 0;
+
+      size_t lRead = std::min(size, lFileLength - offset);
+      memcpy(data, lData + offset, lRead);
+      return lRead;
+    }
 
     if (theFileLength < (size_t)offset)
     {
@@ -124,15 +286,17 @@ namespace gridfs {
   File::truncate()
   {
     // create update filter and query
-    mongo::BSONObj filter = BSON("_id" << gridfile().getFileField("_id").OID());
+    mongo::BSONObj filter = BSON("_id" << file(STAT_FIELDS)["_id"].OID());
     mongo::BSONObj update = BSON( "$set" 
-                               << BSON ( "length" << 0 ));
+                               << BSON ( "length" << 0 )
+                               << "$unset"
+                               << BSON ( "data" << 1 << "holes" << 1 << "storedLength" << 1 ));
 
     // TODO DK this is not multi process safe because it updates an existing entry and 
     // doesn't store a new file entry, but don't see a better solution yet.
     // As an alternative, you could read the stat first and then create a new file but 
     // this is also not multi process safe (race condition between 2 steps) 
-    theConnection->update(filesCollection(), filter, update);
+    connection()->update(filesCollection(), filter, update);
 
     synchonizeUpdate();
   }
@@ -150,22 +314,139 @@ namespace gridfs {
     assert(offset + size <= theChunkSize);
     assert(offset + size <= theFileLength);
 
+    // holes of sparse files are not stored, no need to ask mongo
+    if (is_hole(chunkN))
+    {
+      memset(data, 0, size);
+      return size;
+    }
+
     // see if we have the right chunk in cache. Fetch it if not.
     if(chunkN != theCachedChunkN){ 
-      theCachedChunk = gridfile().getChunk(chunkN);
+      mongo::BSONObj lChunk;
+      bool lFetched = false;
+
+      // it might already be on its way
+      ReadAhead::iterator lAhead = theReadAhead.find(chunkN);
+      if (lAhead != theReadAhead.end())
+      {
+        if (lAhead->second->wait())
+        {
+          lChunk = lAhead->second->chunk();
+          lFetched = true;
+        }
+        theReadAhead.erase(lAhead);
+      }
+
+      if (!lFetched)
+      {
+        mongo::BSONObjBuilder lQueryObj;
+        lQueryObj.appendAs(file()["_id"], "files_id");
+        lQueryObj.append("n", chunkN);
+        mongo::Query lQuery(lQueryObj.obj());
+        int lOptions = route(lQuery);
+        lChunk = connection()->findOne(chunksCollection(), lQuery, 0, lOptions);
+      }
+
+      theCachedChunkIsHole = lChunk.isEmpty();
+      theCachedChunk = mongo::GridFSChunk(lChunk);
+      read_ahead(chunkN, theCachedChunkN);
       theCachedChunkN = chunkN;
       syslog(LOG_DEBUG, "fetched chunk %i into cache of file %s",
           chunkN, path().c_str());
     }
 
+    // chunks missing within the file length are read as zeros
+    if (theCachedChunkIsHole)
+    {
+      memset(data, 0, size);
+      return size;
+    }
+
     // fill buffer as requested
     int len;
     const char* chunk_data = theCachedChunk.data(len);
-    memcpy(data, chunk_data + offset, size);
+    size_t available = ((size_t)len > (size_t)offset)
+      ? std::min(size, (size_t)len - offset)
+      : 0;
+    memcpy(data, chunk_data + offset, available);
+    memset(data + available, 0, size - available);
 
     return size;
   }
 
+  void
+  File::read_ahead(int chunkN, int previousChunkN)
+  {
+    // the ones before have been skipped
+    theReadAhead.erase(theReadAhead.begin(), theReadAhead.lower_bound(chunkN));
+
+    IoExecutor* lIo = FUSE.io();
+    if (!lIo || FUSE.config.readahead_chunks == 0)
+      return;
+
+    // only if read sequentially
+    if (chunkN != 0 && chunkN != previousChunkN + 1)
+      return;
+
+    // all requests of a file go to the same thread such that they can
+    // be fetched with a single query
+    size_t lAffinity = boost::hash<std::string>()(path());
+
+    int lChunks = (int)((theFileLength + theChunkSize - 1) / theChunkSize);
+    for (int lChunkN = chunkN + 1;
+         lChunkN <= chunkN + (int)FUSE.config.readahead_chunks && lChunkN < lChunks;
+         ++lChunkN)
+    {
+      if (is_hole(lChunkN) || theReadAhead.find(lChunkN) != theReadAhead.end())
+        continue;
+
+      boost::shared_ptr<ChunkRequest> lRequest(
+          new ChunkRequest(path(), theChanged, file()["_id"], lChunkN));
+      theReadAhead[lChunkN] = lRequest;
+      lIo->submit(lRequest, lAffinity);
+    }
+  }
+
+  void
+  File::init_holes()
+  {
+    theHoles.clear();
+
+    mongo::BSONElement lHoles = file()["holes"];
+    if (lHoles.type() != mongo::Array)
+      return;
+
+    // stored as a flat array [first, count, first, count, ...]
+    // in ascending order of the chunk numbers
+    std::vector<mongo::BSONElement> lValues = lHoles.Array();
+    for (size_t i = 0; i + 1 < lValues.size(); i += 2)
+    {
+      theHoles.push_back(
+          std::make_pair(lValues[i].numberInt(), lValues[i+1].numberInt()));
+    }
+  }
+
+  bool
+  File::is_hole(int chunkN) const
+  {
+    if (theHoles.empty())
+      return false;
+
+    // find the last run starting at or before chunkN
+    std::vector<std::pair<int, int> >::const_iterator lRun =
+      std::upper_bound(
+          theHoles.begin(),
+          theHoles.end(),
+          std::make_pair(chunkN, INT_MAX));
+
+    if (lRun == theHoles.begin())
+      return false;
+
+    --lRun;
+    return chunkN < lRun->first + lRun->second;
+  }
+
   void
   File::init_memory()
   {
@@ -197,11 +478,14 @@ namespace gridfs {
   }
 
   void
-  File::extend_memory()
+  File::extend_memory(size_t aMinSize)
   {
+    // grow in multiples of the chunk size
+    size_t lNewSize = ((aMinSize + theChunkSize - 1) / theChunkSize) * theChunkSize;
+
     theData = mremap(theData /* old address */,
                      theCurrentDataSize,
-                     (theCurrentDataSize + theChunkSize) /* new extended size */,
+                     lNewSize /* new extended size */,
                      MREMAP_MAYMOVE /* kernel is permitted to relocate the mapping to a new virtual address */);
 
     // check if anything went wrong
@@ -216,7 +500,7 @@ namespace gridfs {
     }
     
     // successfully extended virtual memory
-    theCurrentDataSize+=theChunkSize;
+    theCurrentDataSize = lNewSize;
   }
 
   void
@@ -226,6 +510,7 @@ namespace gridfs {
     {
       munmap(theData,theCurrentDataSize);
       theWritten = 0;
+      theMaxWrite = 0;
       theHasChanges = false; 
       theCurrentDataSize = 0;
     }
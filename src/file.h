@@ -2,12 +2,18 @@
 
 #include "gridfs_fuse.h"
 #include <pthread.h>
+#include <map>
+#include <vector>
+#include <utility>
+#include <boost/shared_ptr.hpp>
 
 #include "filesystem_entry.h"
 
 
 namespace gridfs {
 
+  class ChunkRequest;
+
   class File : public FilesystemEntry
   {
     public:
@@ -39,12 +45,23 @@ namespace gridfs {
       // into one chunk
       size_t
       read(int chunkN, char *data, size_t size, off_t offset);
+
+      void
+      init_holes();
+
+      bool
+      is_hole(int chunkN) const;
+
+      // fetches the chunks following chunkN in the background
+      // if the file is read sequentially
+      void
+      read_ahead(int chunkN, int previousChunkN);
    
       void 
       init_memory();
 
       void 
-      extend_memory();
+      extend_memory(size_t aMinSize);
 
       void
       free_memory();
@@ -52,12 +69,21 @@ namespace gridfs {
       size_t theFileLength;
       unsigned int theChunkSize;
       size_t theWritten;
+      size_t theMaxWrite;
       size_t theCurrentDataSize;
       void* theData;
       bool theHasChanges;
       int theCachedChunkN;
+      bool theCachedChunkIsHole;
       mongo::GridFSChunk theCachedChunk;
 
+      // (first chunk, number of chunks) of the runs not stored in mongo
+      std::vector<std::pair<int, int> > theHoles;
+
+      // chunks being fetched ahead by chunk number
+      typedef std::map<int, boost::shared_ptr<ChunkRequest> > ReadAhead;
+      ReadAhead theReadAhead;
+
       pthread_mutex_t mutex_read;
   }; 
 
@@ -1,60 +1,84 @@
 #include "filesystem_entry.h"
 #include "gridfs_fuse.h"
+#include "unlinker.h"
+#include "io_executor.h"
+#include "read_router.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <ctime>
+#include <set>
 #include <stdexcept>
 #include <sstream>
+#include <boost/shared_ptr.hpp>
 #include "mongo/bson/bsonobj.h"
+#include "mongo/util/md5.hpp"
+#include "mongo/util/net/message.h"
 
 namespace gridfs {
 
+  const char* const FilesystemEntry::UNLINKED = ":unlinked";
+
   FilesystemEntry::FilesystemEntry(const std::string& aPath):
     thePath(aPath),
-    theConnection(FUSE.connection_string()),
-    theGridFS(
-        *theConnection.get(),
-        FUSE.config.mongo_db,
-        FUSE.config.mongo_collection_prefix)
+    theFileFields(NO_FIELDS),
+    theChanged(false),
+    theSecondary(false)
   {
   }
 
   FilesystemEntry::~FilesystemEntry()
   {
-    // put it back into the connection pool
-    theConnection.done();
   }
   
-  mongo::GridFile&
-  FilesystemEntry::gridfile()
+  const mongo::BSONObj&
+  FilesystemEntry::file(Fields aFields)
   {
-    // fetch the file lazyly only if needed
-    if (theGridFile.get()==0)
+    // fetch the file lazyly only if needed and only the fields asked for
+    // (e.g. not the md5 or large user metadata for a getattr)
+    if (theFileFields < aFields)
     {
-      theGridFile.reset(new mongo::GridFile(theGridFS.findFile(thePath)));
+      static const mongo::BSONObj lNameFields =
+        BSON("_id" << 0 << "filename" << 1);
+      static const mongo::BSONObj lLinkFields =
+        mongo::BSONObjBuilder().appendElements(statFields()).append("data", 1).obj();
+
+      const mongo::BSONObj* lFields = 0;
+      switch (aFields)
+      {
+        case NAME_FIELDS: lFields = &lNameFields; break;
+        case STAT_FIELDS: lFields = &statFields(); break;
+        case LINK_FIELDS: lFields = &lLinkFields; break;
+        default: break;
+      }
+
+      // same as GridFS::findFile, the latest upload wins
+      mongo::Query lQuery(BSON("filename" << thePath));
+      lQuery.sort(BSON("uploadDate" << -1));
+      int lOptions = route(lQuery);
+      theFile = connection()->findOne(filesCollection(), lQuery, lFields, lOptions);
+      theFileFields = aFields;
     }
-    return *(theGridFile.get());
+    return theFile;
   }
 
   void
   FilesystemEntry::stat(struct stat *stbuf)
   {
-    stat(gridfile(), stbuf);
+    stat(file(STAT_FIELDS), stbuf);
   }
 
   void
-  FilesystemEntry::stat(mongo::GridFile& gridfile, struct stat *stbuf)
+  FilesystemEntry::stat(const mongo::BSONObj& file, struct stat *stbuf)
   {
     // sanity
-    assert(gridfile.exists());
+    assert(!file.isEmpty());
     memset(stbuf, 0, sizeof(struct stat));
 
     // now set the stat fields we know
-    time_t lTime;
-    stat(gridfile, stbuf->st_mode, stbuf->st_uid, stbuf->st_gid, lTime);
-    stbuf->st_mtime = lTime;
-    stbuf->st_atime = lTime; // not correct, but for completeness
-    stbuf->st_ctime = lTime; // not correct, but for completeness
+    Metadata lMetadata(file, FUSE.config.default_uid, FUSE.config.default_gid);
+    lMetadata.toStat(stbuf);
     
     // set number of links not too accurate
     if (stbuf->st_mode & S_IFDIR)
@@ -66,7 +90,28 @@ namespace gridfs {
     if (stbuf->st_mode & S_IFDIR)
       stbuf->st_size = 4096;
     else 
-      stbuf->st_size =  gridfile.getContentLength();
+      stbuf->st_size = file["length"].numberLong();
+
+    // the number of 512 byte blocks only counts what is really stored
+    // in the chunks collection (i.e. without the holes of sparse files)
+    mongo::BSONElement lStoredLength = file["storedLength"];
+    off_t lStored = lStoredLength.isNumber()
+      ? lStoredLength.numberLong()
+      : stbuf->st_size;
+    stbuf->st_blocks = (lStored + 511) / 512;
+  }
+
+  const mongo::BSONObj&
+  FilesystemEntry::statFields()
+  {
+    static const mongo::BSONObj lFields = BSON(
+        "filename" << 1 <<
+        "uploadDate" << 1 <<
+        "length" << 1 <<
+        "contentType" << 1 <<
+        "metadata" << 1 <<
+        "storedLength" << 1);
+    return lFields;
   }
 
   void
@@ -76,13 +121,23 @@ namespace gridfs {
       gid_t gid,
       const std::string& content)
   {
-    // we use the content type to store some extra meta data
-    std::stringstream lContentType;    
-    lContentType << "m:" << mode << "|u:" << uid << "|g:" << gid << "|t:" << time(0);
+    Metadata lMetadata(mode, uid, gid);
     const char* data = content.c_str();
     size_t length = content.length();
 
-    gridfs().storeFile(data, length, path(), lContentType.str());    
+    if (length == 0)
+    {
+      // directories and empty files don't need the file store at all
+      connection()->insert(filesCollection(),
+          emptyFile(path(), lMetadata.toBSON()));
+    }
+    else
+    {
+      // the target of a symbolic link is always stored inline such
+      // that readlink doesn't need to read any chunks
+      storeFile(data, length, lMetadata.toBSON(),
+          FUSE.chunkSize(path(), length, length), S_ISLNK(mode));
+    }
 
     synchonizeUpdate();
 
@@ -91,133 +146,688 @@ namespace gridfs {
   }
 
   void
-  FilesystemEntry::remove()
+  FilesystemEntry::createDirectories(mode_t mode, uid_t uid, gid_t gid)
   {
-    gridfs().removeFile(path());
+    // this entry and all its ancestors, deepest first
+    std::vector<std::string> lPaths(1, path());
+    std::string lParent;
+    while (parentPath(lPaths.back(), lParent))
+      lPaths.push_back(lParent);
+
+    // find the existing ones with a single query on the filename index
+    mongo::BSONArrayBuilder lIn;
+    for (size_t i = 0; i < lPaths.size(); ++i)
+      lIn.append(lPaths[i]);
+
+    std::set<std::string> lExisting;
+    const mongo::BSONObj lFields = BSON("_id" << 0 << "filename" << 1);
+    std::auto_ptr<mongo::DBClientCursor> lCursor = connection()->query(
+        filesCollection(),
+        BSON("filename" << BSON("$in" << lIn.arr())),
+        0, 0,
+        &lFields);
+    while (lCursor->more())
+      lExisting.insert(lCursor->next()["filename"].str());
+
+    // and insert the missing ones in one batch, top-down
+    const mongo::BSONObj lMetadata = Metadata(mode, uid, gid).toBSON();
+    std::vector<mongo::BSONObj> lMissing;
+    for (size_t i = lPaths.size(); i > 0; --i)
+      if (lExisting.find(lPaths[i - 1]) == lExisting.end())
+        lMissing.push_back(emptyFile(lPaths[i - 1], lMetadata));
 
+    if (lMissing.empty())
+      return;
+
+    connection()->insert(filesCollection(), lMissing);
     synchonizeUpdate();
+    for (size_t i = lPaths.size(); i > 0; --i)
+      if (lExisting.find(lPaths[i - 1]) == lExisting.end())
+        written(lPaths[i - 1]);
+
+    force_reload();
+  }
+
+  bool
+  FilesystemEntry::remove()
+  {
+    return unlink(BSON("filename" << path())) > 0;
+  }
+
+  bool
+  FilesystemEntry::removeTree(std::vector<std::string>& aRemoved)
+  {
+    // the descendants only to invalidate their cached attributes
+    const std::string lRegex = "^" + pathregex() + "/";
+    static const mongo::BSONObj lFields = BSON("_id" << 0 << "filename" << 1);
+    std::auto_ptr<mongo::DBClientCursor> lCursor = connection()->query(
+        filesCollection(),
+        mongo::Query(BSON("filename" << BSON("$regex" << lRegex))).sort("filename"),
+        0, 0,
+        &lFields,
+        0,
+        FUSE.config.readdir_batch_size);
+
+    // sorted, i.e. all versions of a path are next to each other
+    std::string lLast;
+    while (lCursor->more())
+    {
+      std::string lPath = lCursor->next().getStringField("filename");
+      if (lPath != lLast)
+        aRemoved.push_back(lPath);
+      lLast = lPath;
+    }
+    lCursor.reset();
+
+    mongo::BSONArrayBuilder lOr;
+    lOr.append(BSON("filename" << path()));
+    lOr.append(BSON("filename" << BSON("$regex" << lRegex)));
+    return unlink(BSON("$or" << lOr.arr())) > 0;
+  }
+
+  /**
+   * marks the files documents matching aQuery as unlinked. They keep
+   * their path in "unlinked" such that oplog tailers of other mounts
+   * know what to evict.
+   */
+  long long
+  FilesystemEntry::unlink(const mongo::BSONObj& aQuery)
+  {
+    connection()->update(
+        filesCollection(),
+        aQuery,
+        BSON("$set" << BSON(
+            "filename" << UNLINKED <<
+            "parent" << UNLINKED <<
+            "unlinked" << path())),
+        false,
+        true);
+
+    mongo::BSONObj lErrorObj = connection()->getLastErrorDetailed();
+    if (lErrorObj.getField("err").ok() && !lErrorObj.getField("err").isNull())
+    {
+      std::stringstream lErrorMsg;
+      lErrorMsg << "Unlinking failed: " << lErrorObj.jsonString();
+      throw std::runtime_error(lErrorMsg.str());
+    }
+
+    force_reload();
+    written(path(), true);
+
+    long long lCount = lErrorObj["n"].numberLong();
+    if (lCount > 0 && FUSE.unlinker())
+      FUSE.unlinker()->wakeup();
+    return lCount;
   }
 
   void
   FilesystemEntry::chown(uid_t uid, gid_t gid)
   {
-    mode_t st_mode;
-    uid_t dummy_uid;// will not be used
-    gid_t dummy_gid;// will not be used
-    time_t st_time;
-    stat(gridfile(), st_mode, dummy_uid, dummy_gid, st_time); // we need the mode/time to leave it unchanged
+    Metadata lMetadata(file(STAT_FIELDS), FUSE.config.default_uid, FUSE.config.default_gid);
+    lMetadata.uid = uid;
+    lMetadata.gid = gid;
+    lMetadata.ctime = Metadata::now();
 
-    updateContentType(gridfile(), st_mode /*unchanged*/, uid, gid, st_time /*unchanged*/);
+    updateMetadata(lMetadata, BSON(
+          "metadata.uid" << (int)uid <<
+          "metadata.gid" << (int)gid <<
+          "metadata.ctime" << Metadata::toNanos(lMetadata.ctime)));
   }
 
   void
   FilesystemEntry::chmod(mode_t mode)
   {
-    mode_t dummy_mode;// will not be used
-    uid_t st_uid;
-    gid_t st_gid;
-    time_t st_time;
-    stat(gridfile(), dummy_mode, st_uid, st_gid, st_time); // we need the uid/gid/time to leave it unchanged
+    Metadata lMetadata(file(STAT_FIELDS), FUSE.config.default_uid, FUSE.config.default_gid);
+    lMetadata.mode = mode;
+    lMetadata.ctime = Metadata::now();
 
-    updateContentType(gridfile(), mode, st_uid /*unchanged*/, st_gid /*unchanged*/, st_time /*unchanged*/);
+    updateMetadata(lMetadata, BSON(
+          "metadata.mode" << (int)mode <<
+          "metadata.ctime" << Metadata::toNanos(lMetadata.ctime)));
   }
 
   void
-  FilesystemEntry::utimes(time_t time)
+  FilesystemEntry::utimes(const struct timespec& atime, const struct timespec& mtime)
   {
-    mode_t st_mode;
-    uid_t st_uid;
-    gid_t st_gid;
-    time_t dummy_time; // will not be used
-    stat(gridfile(), st_mode, st_uid, st_gid, dummy_time); // we need the mode/uid/gid to leave it unchanged
+    Metadata lMetadata(file(STAT_FIELDS), FUSE.config.default_uid, FUSE.config.default_gid);
+    struct timespec lNow = Metadata::now();
+    mongo::BSONObjBuilder lChanged;
+
+#   ifdef UTIME_OMIT
+    if (atime.tv_nsec != UTIME_OMIT)
+#   endif
+    {
+      lMetadata.atime = atime;
+#     ifdef UTIME_NOW
+      if (atime.tv_nsec == UTIME_NOW)
+        lMetadata.atime = lNow;
+#     endif
+      lChanged.append("metadata.atime", Metadata::toNanos(lMetadata.atime));
+    }
+
+#   ifdef UTIME_OMIT
+    if (mtime.tv_nsec != UTIME_OMIT)
+#   endif
+    {
+      lMetadata.mtime = mtime;
+#     ifdef UTIME_NOW
+      if (mtime.tv_nsec == UTIME_NOW)
+        lMetadata.mtime = lNow;
+#     endif
+      lChanged.append("metadata.mtime", Metadata::toNanos(lMetadata.mtime));
+    }
+
+    lMetadata.ctime = lNow;
+    lChanged.append("metadata.ctime", Metadata::toNanos(lNow));
 
-    updateContentType(gridfile(), st_mode /*unchanged*/, st_uid /*unchanged*/, st_gid /*unchanged*/, time);
+    updateMetadata(lMetadata, lChanged.obj());
   }
 
   void
-  FilesystemEntry::force_reload()
+  FilesystemEntry::rename(
+      const std::string& aNewPath,
+      std::vector<std::string>& aMoved)
   {
-    theGridFile.reset();
-  }
+    struct stat lStat;
+    stat(&lStat);
 
-  void
-  FilesystemEntry::stat(mongo::GridFile& gridfile, mode_t& mode, uid_t& uid, gid_t& gid, time_t& time)
-  {
-    // get mode, uid and gid from contenttype
-    // if not (mis)used as such, use defaults
-    mode = S_IFREG | 0644; // defaults to a file because that is only supported natively in mongo gridfs
-    uid = FUSE.config.default_uid; // default
-    gid = FUSE.config.default_gid; // default
-    std::string lContentType = gridfile.getContentType();
-    char* lContentTypeCopy = new char[lContentType.size()+1]; // strtok wants char* not const char*
-    std::copy(lContentType.begin(), lContentType.end(), lContentTypeCopy);
-    lContentTypeCopy[lContentType.size()] = '\0';
-    char* tok = strtok(lContentTypeCopy,":|"); // we expect e.g. "m:16877|u:0|g:0|t:1321927291"
-    while(tok != NULL)
+    // the files documents of all descendants, collected before any
+    // of them is changed
+    std::vector<std::pair<mongo::BSONObj, std::string> > lDescendants;
+    if (S_ISDIR(lStat.st_mode))
     {
-      // should be m, u or g
-      char type = tok[0];
-      switch (type)
+      static const mongo::BSONObj lFields = BSON("_id" << 1 << "filename" << 1);
+      const std::string lRegex = "^" + pathregex() + "/";
+
+      std::auto_ptr<mongo::DBClientCursor> lCursor = connection()->query(
+          filesCollection(),
+          mongo::Query(BSON("filename" << BSON("$regex" << lRegex))).sort("filename"),
+          0, 0, &lFields);
+
+      while (lCursor->more())
       {
-        case 'm':
-          // found st_mode -> fetch value:
-          tok = strtok(NULL,":|");
-          mode = atoi(tok);
-          break;
-        case 'u':
-          // found owner uid -> fetch value:
-          tok = strtok(NULL,":|");
-          uid = atoi(tok);
-          break;
-        case 'g':
-          // found owner gid -> fetch value:
-          tok = strtok(NULL,":|");
-          gid = atoi(tok);
-          break;
-        case 't':
-          // found timestamp -> fetch value:
-          tok = strtok(NULL,":|");
-          time = atoi(tok);
-          break;
+        mongo::BSONObj lFile = lCursor->next();
+        std::string lRelative = std::string(lFile.getStringField("filename")).substr(thePath.size());
+        lDescendants.push_back(std::make_pair(BSON("_id" << lFile["_id"]), lRelative));
       }
-      tok = strtok(NULL,":|");
     }
 
-    // cleanup
-    delete[] lContentTypeCopy;
-    lContentTypeCopy = NULL;
+    // the entry itself, all versions at once
+    std::string lParent;
+    parentPath(aNewPath, lParent);
+    connection()->update(
+        filesCollection(),
+        QUERY("filename" << thePath),
+        BSON("$set" << BSON("filename" << aNewPath << "parent" << lParent)),
+        false /* no upsert */,
+        true /* multi */);
+
+    // mongo can't compute the new filenames, so every descendant gets
+    // its own update. They are sent without waiting for each other and
+    // synchronized once at the end.
+    for (size_t i = 0; i < lDescendants.size(); ++i)
+    {
+      const std::string lNewPath = aNewPath + lDescendants[i].second;
+      parentPath(lNewPath, lParent);
+      connection()->update(
+          filesCollection(),
+          lDescendants[i].first,
+          BSON("$set" << BSON("filename" << lNewPath << "parent" << lParent)));
+
+      // versions of the same entry are reported once
+      if (aMoved.empty() || aMoved.back() != lDescendants[i].second)
+        aMoved.push_back(lDescendants[i].second);
+    }
+
+    synchonizeUpdate();
+    written(path(), true);
+    written(aNewPath, true);
+
+    force_reload();
+  }
+
+  void
+  FilesystemEntry::force_reload()
+  {
+    theFileFields = NO_FIELDS;
+    theFile = mongo::BSONObj();
+  }
+
+  mongo::BSONObj
+  FilesystemEntry::userMetadata(const mongo::BSONObj& file)
+  {
+    mongo::BSONElement lMetadata = file["metadata"];
+    return lMetadata.type() == mongo::Object
+      ? lMetadata.Obj()
+      : mongo::BSONObj();
   }
 
   void
-  FilesystemEntry::updateContentType(mongo::GridFile& gridfile, 
-                                     mode_t mode, 
-                                     uid_t uid, 
-                                     gid_t gid,
-                                     time_t time)
+  FilesystemEntry::updateMetadata(
+      const Metadata& aMetadata,
+      const mongo::BSONObj& aChanged)
   {
-    std::stringstream lContentType;    
-    lContentType << "m:" << mode << "|u:" << uid << "|g:" << gid << "|t:" << time;
+    // entries with legacy metadata get the complete subdocument
+    const mongo::BSONObj& lFile = file(STAT_FIELDS);
+    mongo::BSONObj lSet = Metadata::isStructured(lFile)
+      ? aChanged
+      : BSON("metadata" << aMetadata.toBSON(userMetadata(lFile)));
 
     // create update filter and query
-    mongo::OID id(gridfile.getFileField("_id").OID().str());
-    mongo::Query filter = QUERY("_id" << id);
-    mongo::BSONObj update = BSON( "$set" 
-                               << BSON ( "contentType" << lContentType.str() ));
+    mongo::Query filter = QUERY("_id" << lFile["_id"].OID());
+    mongo::BSONObj update = BSON("$set" << lSet);
 
     // update it
     // TODO DK this is not multi process safe because it doesn't store a new file 
     //         entry, but don't see a better solution yet.
-    theConnection->update(filesCollection(), filter, update);
+    connection()->update(filesCollection(), filter, update);
 
     synchonizeUpdate();
   }
 
-  std::string
+  const std::string&
   FilesystemEntry::filesCollection()
   {
-    return std::string(FUSE.config.mongo_db) + "." + 
-      FUSE.config.mongo_collection_prefix +
-      ".files";
+    return MongoContext::filesCollection();
+  }
+
+  const std::string&
+  FilesystemEntry::chunksCollection()
+  {
+    return MongoContext::chunksCollection();
+  }
+
+  bool
+  FilesystemEntry::parentPath(const std::string& aPath, std::string& aParent)
+  {
+    size_t lSlash = aPath.rfind('/');
+    if (lSlash == std::string::npos)
+      return false;
+
+    aParent = aPath.substr(0, lSlash);
+    return true;
+  }
+
+  const std::string
+  FilesystemEntry::pathregex()
+  {
+    // we have to escape all special characters (e.g. '.' -> '\\.') from the path
+    int len = path().length();
+    std::stringstream regex;
+    for (int i = 0; i < len; i++) {
+      char ch = path().at(i);
+      switch(ch)
+      {
+        case '.':
+        case '^':
+        case '$':
+        case '|':
+        case '(':
+        case ')':
+        case '[':
+        case ']':
+        case '*':
+        case '+':
+        case '?':
+        case '\\':
+          regex << '\\' << ch; break;
+        default:
+          regex << ch; break;
+      }
+    }
+    return regex.str();
+  }
+
+  static bool
+  is_zero(const char* data, size_t length)
+  {
+    // if the first byte is zero and every byte equals its successor,
+    // all of them are zero
+    return length == 0
+      || (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
+  }
+
+  // size of the standard message header (length, id, response to, opcode)
+  static const int MSG_HEADER_SIZE = 16;
+
+  // bytes of chunk documents sent with a single OP_INSERT, which is
+  // confirmed before the next one is sent
+  static const size_t MAX_INSERT_BATCH = 8 * 1024 * 1024;
+
+  /**
+   * inserts the chunk documents {files_id, n, data} of a file without
+   * creating BSONObjs first. The chunks are appended to a single OP_INSERT
+   * message built in a buffer that is reused for all chunks of the file.
+   * So the chunk data is copied once from the given memory into the
+   * message, which is then sent from that same buffer.
+   *
+   * A message is sent once it holds MAX_INSERT_BATCH bytes and is
+   * confirmed with getLastError, which reports the first document mongo
+   * couldn't insert. It only reports the latest operation of the
+   * connection, i.e. a single check after several messages could miss
+   * the failure of an earlier one.
+   */
+  class ChunkInserter
+  {
+    public:
+      // aSize: bytes of all chunks to be inserted, to size the buffer
+      ChunkInserter(
+          mongo::DBClientBase& aConnection,
+          const std::string& aCollection,
+          const mongo::OID& aFileId,
+          size_t aSize)
+        : theConnection(aConnection),
+          theCollection(aCollection),
+          theFileId(aFileId),
+          theBuffer(aSize
+              ? (int)(std::min(aSize, MAX_INSERT_BATCH) + aCollection.size() + 128)
+              : 0),
+          theCount(0),
+          theFirstChunkN(0)
+      {}
+
+      void
+      add(int aChunkN, const char* aData, size_t aLength)
+      {
+        if (theCount && theBuffer.len() + aLength > MAX_INSERT_BATCH)
+          flush();
+
+        if (theCount == 0)
+        {
+          // OP_INSERT: header, flags, collection, documents
+          theBuffer.reset();
+          theBuffer.skip(MSG_HEADER_SIZE);
+          theBuffer.appendNum((int)0);
+          theBuffer.appendStr(theCollection);
+          theFirstChunkN = aChunkN;
+        }
+
+        mongo::BSONObjBuilder lChunk(theBuffer);
+        lChunk.append("files_id", theFileId);
+        lChunk.append("n", aChunkN);
+        lChunk.appendBinData("data", (int)aLength, mongo::BinDataGeneral, aData);
+        lChunk.done();
+        ++theCount;
+      }
+
+      // sends what has been added and waits until it's inserted
+      void
+      flush()
+      {
+        if (theCount == 0)
+          return;
+        theCount = 0;
+
+        // the buffer is reused, i.e. nothing of the header may be left over.
+        // say assigns the request id, an insert doesn't respond to anything
+        mongo::MsgData* lHeader = reinterpret_cast<mongo::MsgData*>(theBuffer.buf());
+        lHeader->len = theBuffer.len();
+        lHeader->id = 0;
+        lHeader->responseTo = 0;
+        lHeader->setOperation(mongo::dbInsert);
+
+        // the message doesn't take ownership of the buffer
+        mongo::Message lMessage(theBuffer.buf(), false);
+        theConnection.say(lMessage);
+
+        std::string lError = theConnection.getLastError();
+        if (!lError.empty())
+        {
+          std::ostringstream lMessageText;
+          lMessageText << "inserting chunks from " << theFirstChunkN << " on failed: " << lError;
+          throw std::runtime_error(lMessageText.str());
+        }
+      }
+
+    private:
+      // forbid copying
+      ChunkInserter(const ChunkInserter&);
+      ChunkInserter& operator=(const ChunkInserter&);
+
+      mongo::DBClientBase& theConnection;
+      const std::string&   theCollection;
+      const mongo::OID&    theFileId;
+      mongo::BufBuilder    theBuffer;
+      // documents in the message that hasn't been sent yet
+      int                  theCount;
+      int                  theFirstChunkN;
+  };
+
+  /**
+   * inserts a range of chunks of a file over the connection of an I/O
+   * thread (see IoExecutor). The content must stay valid until the
+   * request has been waited for.
+   */
+  class ChunkInsertRequest : public IoRequest
+  {
+    public:
+      struct Chunk
+      {
+        int         theChunkN;
+        const char* theData;
+        size_t      theLength;
+      };
+
+      ChunkInsertRequest(const mongo::OID& aFileId)
+        : theFileId(aFileId),
+          theSize(0)
+      {}
+
+      void
+      add(int aChunkN, const char* aData, size_t aLength)
+      {
+        Chunk lChunk = { aChunkN, aData, aLength };
+        theChunks.push_back(lChunk);
+        theSize += aLength;
+      }
+
+    protected:
+      virtual void
+      run(MongoContext& aContext)
+      {
+        ChunkInserter lInserter(
+            aContext.connection(),
+            aContext.chunksCollection(),
+            theFileId,
+            theSize);
+
+        for (std::vector<Chunk>::const_iterator lIt = theChunks.begin();
+             lIt != theChunks.end();
+             ++lIt)
+          lInserter.add(lIt->theChunkN, lIt->theData, lIt->theLength);
+
+        // the files document must not be inserted before all chunks are,
+        // which are sent over another connection
+        lInserter.flush();
+      }
+
+    private:
+      mongo::OID         theFileId;
+      std::vector<Chunk> theChunks;
+      size_t             theSize;
+  };
+
+  /**
+   * stores the given content as a new version of this entry.
+   *
+   * This does the same as mongo::GridFS::storeFile except that chunks
+   * which only contain zeros are not inserted. The missing chunk numbers
+   * are recorded as pairs of (first chunk, number of chunks) in the
+   * "holes" array of the files document such that readers don't have
+   * to ask mongo for them. Because the server side filemd5 command
+   * cannot deal with missing chunks, the md5 is computed here.
+   *
+   * Content up to inline_threshold bytes is stored as "data" in the
+   * files document itself, i.e. without any chunks at all.
+   *
+   * The chunks of larger files are spread over the I/O threads (see
+   * IoExecutor) and inserted over their connections at the same time.
+   * This returns once all of them have been inserted.
+   */
+  void
+  FilesystemEntry::storeFile(
+      const char* data,
+      size_t length,
+      const mongo::BSONObj& metadata,
+      size_t chunkSize,
+      bool aInline)
+  {
+    const size_t lChunkSize = chunkSize;
+    const std::string lChunksCollection = chunksCollection();
+
+    mongo::OID lId;
+    lId.init();
+
+    md5_state_t lMd5State;
+    md5_init(&lMd5State);
+
+    const bool lInline = length != 0
+      && (aInline || length <= FUSE.config.inline_threshold);
+
+    mongo::BSONArrayBuilder lHoles;
+    int lHoleStart = -1;
+    size_t lStored = 0;
+
+    // consecutive chunks per I/O thread
+    IoExecutor* lIo = FUSE.io();
+    const size_t lChunks = (length + lChunkSize - 1) / lChunkSize;
+    std::vector<boost::shared_ptr<ChunkInsertRequest> > lRequests;
+    if (lIo && lIo->threads() > 1 && !lInline && lChunks > 1)
+    {
+      size_t lThreads = std::min((size_t)lIo->threads(), lChunks);
+      for (size_t i = 0; i < lThreads; ++i)
+        lRequests.push_back(
+            boost::shared_ptr<ChunkInsertRequest>(new ChunkInsertRequest(lId)));
+    }
+    const size_t lChunksPerRequest = lRequests.empty()
+      ? 0
+      : (lChunks + lRequests.size() - 1) / lRequests.size();
+
+    // over the connection of this thread if the chunks aren't spread
+    ChunkInserter lInserter(
+        *connection(),
+        lChunksCollection,
+        lId,
+        lInline || !lRequests.empty() ? 0 : length);
+
+    int lChunkN = 0;
+    for (size_t lOffset = 0;
+         !lInline && lOffset < length;
+         lOffset += lChunkSize, ++lChunkN)
+    {
+      const char* lChunk = data + lOffset;
+      size_t lChunkLength = std::min(lChunkSize, length - lOffset);
+
+      md5_append(&lMd5State, (const md5_byte_t*)lChunk, (int)lChunkLength);
+
+      if (is_zero(lChunk, lChunkLength))
+      {
+        if (lHoleStart < 0)
+          lHoleStart = lChunkN;
+        continue;
+      }
+
+      if (lHoleStart >= 0)
+      {
+        lHoles.append(lHoleStart);
+        lHoles.append(lChunkN - lHoleStart);
+        lHoleStart = -1;
+      }
+
+      if (lRequests.empty())
+        lInserter.add(lChunkN, lChunk, lChunkLength);
+      else
+        lRequests[lChunkN / lChunksPerRequest]->add(lChunkN, lChunk, lChunkLength);
+
+      lStored += lChunkLength;
+    }
+
+    lInserter.flush();
+
+    // the content must not be released before all of them are done
+    std::string lError;
+    for (size_t i = 0; i < lRequests.size(); ++i)
+      lIo->submit(lRequests[i], i);
+    for (size_t i = 0; i < lRequests.size(); ++i)
+      if (!lRequests[i]->wait() && lError.empty())
+        lError = lRequests[i]->error();
+    if (!lError.empty())
+      throw std::runtime_error(lError);
+
+    if (lHoleStart >= 0)
+    {
+      lHoles.append(lHoleStart);
+      lHoles.append(lChunkN - lHoleStart);
+    }
+
+    if (lInline)
+      md5_append(&lMd5State, (const md5_byte_t*)data, (int)length);
+
+    mongo::md5digest lDigest;
+    md5_finish(&lMd5State, lDigest);
+
+    mongo::BSONObjBuilder lFile;
+    lFile << "_id" << lId
+          << "filename" << path();
+
+    // indexed for listing and emptiness checks of directories
+    std::string lParent;
+    if (parentPath(path(), lParent))
+      lFile << "parent" << lParent;
+
+    lFile << "chunkSize" << (int)lChunkSize
+          << "uploadDate" << mongo::DATENOW
+          << "md5" << mongo::digestToString(lDigest);
+
+    // same as the driver: use an int if it fits
+    if (length < 1024*1024*1024)
+      lFile << "length" << (int)length;
+    else
+      lFile << "length" << (long long)length;
+
+    lFile << "metadata" << metadata;
+
+    if (lInline)
+      lFile.appendBinData("data", (int)length, mongo::BinDataGeneral, data);
+
+    if (lHoles.arrSize() > 0)
+    {
+      lFile.appendArray("holes", lHoles.arr());
+      lFile << "storedLength" << (long long)lStored;
+    }
+
+    connection()->insert(filesCollection(), lFile.obj());
+  }
+
+  /**
+   * the files document of an entry without content, i.e. what storeFile
+   * would insert for an empty file but without computing anything.
+   */
+  mongo::BSONObj
+  FilesystemEntry::emptyFile(
+      const std::string& aPath,
+      const mongo::BSONObj& aMetadata)
+  {
+    // md5 of the empty string
+    static const char* const EMPTY_MD5 = "d41d8cd98f00b204e9800998ecf8427e";
+
+    mongo::OID lId;
+    lId.init();
+
+    mongo::BSONObjBuilder lFile;
+    lFile << "_id" << lId
+          << "filename" << aPath;
+
+    std::string lParent;
+    if (parentPath(aPath, lParent))
+      lFile << "parent" << lParent;
+
+    lFile << "chunkSize" << (int)FUSE.chunkSize(aPath, 0, 0)
+          << "uploadDate" << mongo::DATENOW
+          << "md5" << EMPTY_MD5
+          << "length" << 0
+          << "metadata" << aMetadata;
+    return lFile.obj();
   }
 
   /**
@@ -232,13 +842,38 @@ namespace gridfs {
   void
   FilesystemEntry::synchonizeUpdate()
   {
-    mongo::BSONObj lErrorObj = theConnection->getLastErrorDetailed();
+    mongo::BSONObj lErrorObj = connection()->getLastErrorDetailed();
     if (lErrorObj.getField("err").ok() && !lErrorObj.getField("err").isNull())
     {
       std::stringstream lErrorMsg;
       lErrorMsg << "An update operation failed: " << lErrorObj.jsonString();
       throw std::runtime_error(lErrorMsg.str());
     }
+
+    written(path());
+  }
+
+  int
+  FilesystemEntry::route(mongo::Query& aQuery)
+  {
+    ReadRouter* lRouter = FUSE.reads();
+    if (!lRouter || theChanged)
+      return 0;
+
+    int lOptions = lRouter->route(aQuery, path());
+    if (lOptions)
+      theSecondary = true;
+    return lOptions;
+  }
+
+  void
+  FilesystemEntry::written(const std::string& aPath, bool aSubtree)
+  {
+    theChanged = true;
+
+    ReadRouter* lRouter = FUSE.reads();
+    if (lRouter)
+      lRouter->written(aPath, aSubtree);
   }
 
 }
@@ -3,12 +3,30 @@
 #include <mongo/client/gridfs.h>
 #include <mongo/client/connpool.h>
 #include <sys/stat.h>
+#include <vector>
+
+#include "metadata.h"
+#include "mongo_context.h"
 
 namespace gridfs {
 
   class FilesystemEntry
   {
     public:
+      // the fields of the files document that are loaded, every
+      // level includes the fields of the ones before
+      enum Fields
+      {
+        NO_FIELDS = 0,
+        NAME_FIELDS,   // filename only, covered by the filename index
+        STAT_FIELDS,   // _id and what's needed by stat and updateMetadata
+        LINK_FIELDS,   // plus the inline target of symbolic links
+        ALL_FIELDS
+      };
+
+      // the filename and parent of unlinked documents, no path starts with it
+      static const char* const UNLINKED;
+
       FilesystemEntry(const std::string& aPath);
 
       virtual
@@ -17,14 +35,21 @@ namespace gridfs {
       const std::string&
       path() { return thePath; }
 
+      // loads at least aFields, i.e. use STAT_FIELDS if the entry
+      // is going to be stat'ed or changed anyway
       bool
-      exists() { return gridfile().exists(); } 
+      exists(Fields aFields = NAME_FIELDS) { return !file(aFields).isEmpty(); } 
 
       void
       stat(struct stat *stbuf);
 
-      void
-      stat(mongo::GridFile& gridfile, struct stat *stbuf);
+      // stat from a files document, e.g. one returned by a listing
+      static void
+      stat(const mongo::BSONObj& file, struct stat *stbuf);
+
+      // the fields of a files document needed by stat
+      static const mongo::BSONObj&
+      statFields();
 
       void 
       create(
@@ -33,9 +58,22 @@ namespace gridfs {
           gid_t gid,
           const std::string& content);
 
-      void 
+      // creates this entry as a directory together with all of its
+      // missing ancestors, inserting them with a single batch
+      void
+      createDirectories(mode_t mode, uid_t uid, gid_t gid);
+
+      // marks all versions of this entry as unlinked, false if there
+      // weren't any. The documents and their chunks are deleted later
+      // by the Unlinker.
+      bool
       remove();
 
+      // removes this entry and everything below with a single update,
+      // aRemoved receives the paths of the removed descendants
+      bool
+      removeTree(std::vector<std::string>& aRemoved);
+
       void 
       chown(uid_t uid, gid_t gid);
 
@@ -43,42 +81,97 @@ namespace gridfs {
       chmod(mode_t mode);
 
       void
-      utimes(time_t time);
+      utimes(const struct timespec& atime, const struct timespec& mtime);
+
+      // moves all versions of this entry and, for directories, of all
+      // its descendants to aNewPath. aMoved receives the paths of the
+      // descendants relative to the entry (e.g. "/sub/file").
+      void
+      rename(const std::string& aNewPath, std::vector<std::string>& aMoved);
 
       void
       force_reload();
 
+      // something has been read from a secondary (see ReadRouter), i.e.
+      // it might miss changes other mounts have invalidated already and
+      // must not be cached for them
+      bool
+      secondary() const { return theSecondary; }
+
+      // the path of the directory containing aPath,
+      // false for the root which has no parent
+      static bool
+      parentPath(const std::string& aPath, std::string& aParent);
+
     protected:
-      mongo::GridFile&
-      gridfile();
+      // the latest version of the files document of this entry
+      // with at least aFields, empty if the entry doesn't exist
+      const mongo::BSONObj&
+      file(Fields aFields = ALL_FIELDS);
 
       mongo::GridFS&
-      gridfs() { return theGridFS; };
+      gridfs() { return MongoContext::get().gridfs(); };
 
-      void 
-      stat(
-        mongo::GridFile& gridfile,
-        mode_t& mode,
-        uid_t& uid,
-        gid_t& gid,
-        time_t& time);
+      // the connection of the calling thread, don't keep it beyond the
+      // current operation (see MongoContext)
+      mongo::DBClientBase*
+      connection() { return &MongoContext::get().connection(); }
+
+      // user defined fields of the metadata subdocument
+      static mongo::BSONObj
+      userMetadata(const mongo::BSONObj& file);
 
+      // sets the changed metadata fields (e.g. {"metadata.mode": ...})
+      // or all of aMetadata if the entry still has legacy metadata
       void 
-      updateContentType(
-          mongo::GridFile& gridfile,
-          mode_t mode,
-          uid_t uid,
-          gid_t gid,
-          time_t time);
+      updateMetadata(
+          const Metadata& aMetadata,
+          const mongo::BSONObj& aChanged);
 
-      std::string
+      const std::string&
       filesCollection();
 
+      const std::string&
+      chunksCollection();
+
+      // the path with all special characters of regular expressions escaped
+      const std::string
+      pathregex();
+
+      // aInline: store the content in the files document regardless
+      // of its length (e.g. the target of a symbolic link)
+      void
+      storeFile(
+          const char* data,
+          size_t length,
+          const mongo::BSONObj& metadata,
+          size_t chunkSize,
+          bool aInline = false);
+
+      // marks the documents matching aQuery as unlinked,
+      // returns the number of documents
+      long long
+      unlink(const mongo::BSONObj& aQuery);
+
+      // the minimal files document of a directory or an empty file
+      static mongo::BSONObj
+      emptyFile(const std::string& aPath, const mongo::BSONObj& aMetadata);
+
       void
       synchonizeUpdate();
 
+      // the query options for a read of this entry, adds the read
+      // preference to aQuery unless it has to go to the primary
+      int
+      route(mongo::Query& aQuery);
+
+      // aPath (and everything below if aSubtree) has been changed, its
+      // reads go to the primary for a while (see ReadRouter)
+      void
+      written(const std::string& aPath, bool aSubtree = false);
+
     private:
-      // forbid copying because of the scoped connedction
+      // forbid copying
       FilesystemEntry(const FilesystemEntry&);
       FilesystemEntry& operator=(const FilesystemEntry&);
 
@@ -87,9 +180,12 @@ namespace gridfs {
   
     protected:
       const std::string               thePath;
-      mongo::ScopedDbConnection       theConnection;
-      mongo::GridFS                   theGridFS;
-      std::auto_ptr<mongo::GridFile>  theGridFile;
+      Fields                          theFileFields;
+      // changed through this object, i.e. read from the primary
+      bool                            theChanged;
+      // see secondary
+      bool                            theSecondary;
+      mongo::BSONObj                  theFile;
   };
 
 }
@@ -10,6 +10,8 @@
 #include "proc.h"
 #include "symlink.h"
 #include "fileinfo.h"
+#include "namespace_index.h"
+#include "statistics.h"
 
 #include <stdio.h>
 #include <errno.h>
@@ -17,6 +19,7 @@
 #include <iostream>
 #include <cassert>
 #include <memory>
+#include <algorithm>
 
 
 /**
@@ -72,6 +75,32 @@ namespace gridfs
   }
 
 
+// ############################################
+  /*********************************************
+   * Initialize filesystem
+   *
+   * Called once fuse runs, i.e. after the process has been
+   * daemonized. Threads started before wouldn't survive the fork.
+   */
+  void*
+  init(struct fuse_conn_info* conn)
+  {
+    FUSE.startThreads();
+    return NULL;
+  }
+
+// ############################################
+  /*********************************************
+   * Clean up filesystem
+   *
+   * Called on filesystem exit.
+   */
+  void
+  destroy(void* private_data)
+  {
+    FUSE.stopThreads();
+  }
+
 // ############################################
   /********************************************* 
    * Get file/folder attributes.
@@ -87,8 +116,26 @@ namespace gridfs
     std::string lPath;
     configure_path(aPath, lPath);
 
+    // the namespace index knows about everything but proc
+    NamespaceIndex* lIndex = FUSE.namespaceIndex();
+    if (lIndex && !is_proc(lPath, aStBuf))
+    {
+      switch (lIndex->get(lPath, aStBuf))
+      {
+        case Memcache::EXISTS:  return 0;
+        case Memcache::MISSING: return -ENOENT;
+        default: break; // not loaded yet
+      }
+    }
+
     Memcache m;
-    if (!m.get(lPath, aStBuf))
+    Memcache::Result lCached = m.get(lPath, aStBuf);
+    if (lCached == Memcache::MISSING)
+    {
+      syslog(LOG_DEBUG, "getattr: cached as nonexistent %s", lPath.c_str());
+      result = -ENOENT;
+    }
+    else if (lCached == Memcache::UNKNOWN)
     {
       try
       {
@@ -103,17 +150,18 @@ namespace gridfs
           FilesystemEntry lEntry(lPath);
 
           //check if path to file, dir or link does exist
-          if (!lEntry.exists())
+          if (!lEntry.exists(FilesystemEntry::STAT_FIELDS))
           {
             syslog(LOG_DEBUG, "getattr: entry does not exists %s",
                 lPath.c_str());
+            Memcache(!lEntry.secondary()).setMissing(lPath);
             result = -ENOENT;
           }
           else
           {
             syslog(LOG_DEBUG, "getattr: entry exists %s", lPath.c_str());
             lEntry.stat(aStBuf); 
-            m.set(lPath, aStBuf);
+            Memcache(!lEntry.secondary()).set(lPath, aStBuf);
           }
         }
 
@@ -147,6 +195,8 @@ namespace gridfs
       
       // create it
       lDir.create(S_IFDIR | mode, st_uid, st_gid, "");
+      Memcache m;
+      m.remove(lPath);
 
     } GRIDFS_CATCH
 
@@ -226,7 +276,7 @@ namespace gridfs
       switch (lInfo->type)
       {
         case FileInfo::DIRECTORY:
-          lInfo->directory->list(buf, filler); break;
+          lInfo->directory->list(buf, filler, offset); break;
         case FileInfo::PROC:
           lInfo->proc->list(buf, filler); break;
         default: assert(false);
@@ -285,6 +335,8 @@ namespace gridfs
 
           // create it in mongo
           lInfo->file->create(S_IFREG | mode, st_uid, st_gid, "");
+          Memcache m;
+          m.remove(lPath);
 
         }
         // put pointer into fileinfo struct
@@ -310,18 +362,23 @@ namespace gridfs
 
     try
     {
-      // load information about the path   
+      // e.g. rm proc/instances/192.168.1.50:11211
+      if (is_proc(lPath, 0))
+      {
+        Proc lProc(lPath);
+        return lProc.remove();
+      }
+
       FilesystemEntry lEntry(lPath);
 
-      //checd if path to file, dir or link does exist
-      if (!lEntry.exists())
+      // a single update which fails if the path doesn't exist,
+      // the content is deleted in the background
+      if (!lEntry.remove())
       {
         syslog(LOG_DEBUG, "unlink: entry does not exists %s", lPath.c_str());
         return -ENOENT;
       }
 
-      lEntry.remove();
-
       Memcache m;
       m.remove(lPath);
 
@@ -330,6 +387,91 @@ namespace gridfs
     return result;
   }
 
+// ############################################
+  /*********************************************
+   * Rename a file, symbolic link, or directory
+   *
+   * Only the filenames of the files documents are changed, the content
+   * isn't copied. Directories are moved together with all descendants.
+   * An existing target is replaced. Note that this isn't atomic, i.e.
+   * other processes might see the target missing for a moment, and that
+   * changes of files which are still open are stored at the old path.
+   */
+  int
+  rename(const char* oldpath, const char* newpath)
+  {
+    int result = 0;
+    std::string lOldPath;
+    configure_path(oldpath, lOldPath);
+    std::string lNewPath;
+    configure_path(newpath, lNewPath);
+
+    if (is_proc(lOldPath, 0) || is_proc(lNewPath, 0))
+      return -EPERM;
+
+    // the root can't be moved and a directory not into itself
+    if (lOldPath == FUSE.config.path_prefix ||
+        lNewPath.compare(0, lOldPath.size() + 1, lOldPath + "/") == 0)
+      return -EINVAL;
+
+    if (lOldPath == lNewPath)
+      return 0;
+
+    try
+    {
+      FilesystemEntry lEntry(lOldPath);
+      if (!lEntry.exists(FilesystemEntry::STAT_FIELDS))
+      {
+        syslog(LOG_DEBUG, "rename: entry does not exists %s", lOldPath.c_str());
+        return -ENOENT;
+      }
+
+      struct stat lStat;
+      lEntry.stat(&lStat);
+
+      Memcache m;
+
+      Directory lTarget(lNewPath);
+      if (lTarget.exists(FilesystemEntry::STAT_FIELDS))
+      {
+        struct stat lTargetStat;
+        lTarget.stat(&lTargetStat);
+
+        if (S_ISDIR(lStat.st_mode) && !S_ISDIR(lTargetStat.st_mode))
+          return -ENOTDIR;
+        if (!S_ISDIR(lStat.st_mode) && S_ISDIR(lTargetStat.st_mode))
+          return -EISDIR;
+        if (S_ISDIR(lTargetStat.st_mode) && !lTarget.isEmpty())
+          return -ENOTEMPTY;
+
+        // otherwise its versions would be newer than the moved ones
+        lTarget.remove();
+        m.remove(lNewPath);
+      }
+
+      std::vector<std::string> lMoved;
+      lEntry.rename(lNewPath, lMoved);
+
+      NamespaceIndex* lIndex = FUSE.namespaceIndex();
+      if (lIndex)
+        lIndex->move(lOldPath, lNewPath);
+
+      m.invalidate(lOldPath);
+      m.invalidate(lNewPath);
+      for (size_t i = 0; i < lMoved.size(); ++i)
+      {
+        m.invalidate(lOldPath + lMoved[i]);
+        m.invalidate(lNewPath + lMoved[i]);
+      }
+
+      syslog(LOG_DEBUG, "rename: moved %s to %s (%d descendants)",
+          lOldPath.c_str(), lNewPath.c_str(), (int)lMoved.size());
+
+    } GRIDFS_CATCH
+
+    return result;
+  }
+
 // ############################################
   /********************************************* 
    * open a File
@@ -418,9 +560,14 @@ namespace gridfs
           result = lInfo->file->write(data, size, offset);
         }
         break;
+        case FileInfo::PROC:
+        {
+          // control files, e.g. rmtree
+          result = lInfo->proc->write(data, size);
+        }
+        break;
         default:
         {
-          // writing into proc not allowed
           assert(false);
         }
       }
@@ -568,8 +715,15 @@ namespace gridfs
         //TODO DK: do we have to check permissions ourselves here? 
         // http://openbook.galileocomputing.de/c_von_a_bis_z/017_c_dateien_verzeichnisse_001.htm
         lInfo.reset(new FileInfo(new Directory(lPath)));
+
+        struct stat lStat;
+        NamespaceIndex* lIndex = FUSE.namespaceIndex();
+        Memcache::Result lKnown = lIndex
+          ? lIndex->get(lPath, &lStat)
+          : Memcache::UNKNOWN;
       
-        if (!lInfo->directory->exists())
+        if (lKnown == Memcache::MISSING ||
+            (lKnown == Memcache::UNKNOWN && !lInfo->directory->exists()))
         {
           syslog(LOG_DEBUG, "opendir: directory does not exist %s",
               lPath.c_str());
@@ -638,6 +792,8 @@ namespace gridfs
 
       // create it in mongo
       lSymlink.create(S_IFLNK | 0777, st_uid, st_gid, lOldPath);
+      Memcache m;
+      m.remove(lNewPath);
       syslog(LOG_INFO, "symlink: created %s pointint to %s",
           lNewPath.c_str(), lOldPath.c_str());
 
@@ -665,15 +821,28 @@ namespace gridfs
 
     try
     {
-      Symlink lSymlink(lPath);
+      Memcache m;
+      std::string lTarget;
 
-      if (!lSymlink.exists())
+      if (!m.getTarget(lPath, lTarget))
       {
-        syslog(LOG_DEBUG, "readlink: entry does not exists %s", lPath.c_str());
-        return -ENOENT;
+        Symlink lSymlink(lPath);
+        struct stat lStat;
+
+        if (!lSymlink.read(lTarget, &lStat))
+        {
+          syslog(LOG_DEBUG, "readlink: entry does not exists %s", lPath.c_str());
+          return -ENOENT;
+        }
+
+        Memcache(!lSymlink.secondary()).set(lPath, &lStat, lTarget);
       }
 
-      lSymlink.read(link, size);
+      // If the linkname is too long to fit in the buffer, it should be truncated.
+      // The buffer size argument includes the space for the terminating null character.
+      size_t lLength = std::min(lTarget.length(), size - 1);
+      memcpy(link, lTarget.c_str(), lLength);
+      link[lLength] = '\0';
 
     } GRIDFS_CATCH
 
@@ -697,7 +866,7 @@ namespace gridfs
       FilesystemEntry lEntry(lPath);
 
       //check if path to file, dir or link does exist
-      if (!lEntry.exists())
+      if (!lEntry.exists(FilesystemEntry::STAT_FIELDS))
       {
         syslog(LOG_DEBUG, "getattr: entry does not exists %s", lPath.c_str());
         return -ENOENT;
@@ -727,7 +896,7 @@ namespace gridfs
     {
       FilesystemEntry lEntry(lPath);
 
-      if (!lEntry.exists())
+      if (!lEntry.exists(FilesystemEntry::STAT_FIELDS))
       {
        result = -ENOENT;
       }
@@ -757,11 +926,15 @@ namespace gridfs
 
     try
     {
+      // opening a control file for writing truncates it first
+      if (is_proc(lPath, 0))
+        return 0;
+
       // load information about the path   
       File lFile(lPath);
 
       //check if path to file does exist
-      if(!lFile.exists())
+      if(!lFile.exists(FilesystemEntry::STAT_FIELDS))
       {
         syslog(LOG_DEBUG, "truncate: entry does not exists %s", lPath.c_str());
         return -ENOENT;
@@ -810,13 +983,13 @@ namespace gridfs
       File lFile(lPath);
 
       //check if path to file does exist
-      if (!lFile.exists())
+      if (!lFile.exists(FilesystemEntry::STAT_FIELDS))
       {
         syslog(LOG_DEBUG, "utimens: entry does not exists %s", lPath.c_str());
         return -ENOENT;
       }
 
-      lFile.utimes(tv[1].tv_sec);
+      lFile.utimes(tv[0], tv[1]);
       Memcache m;
       m.remove(lPath);
 
@@ -824,4 +997,23 @@ namespace gridfs
 
     return result; // 0 for success
   }
+
+// ############################################
+  /********************************************* 
+   * Get file system statistics
+   *
+   * Answered from the statistics which are read in the background,
+   * i.e. it never waits for mongo. The 'f_fsid' and 'f_flag' fields
+   * are ignored.
+   */
+  int
+  statfs(const char* path, struct statvfs* buf)
+  {
+    Statistics* lStatistics = FUSE.statistics();
+    if (!lStatistics)
+      return -ENOSYS;
+
+    lStatistics->get(buf);
+    return 0;
+  }
 }
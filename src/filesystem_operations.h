@@ -7,12 +7,19 @@
 #include "gridfs_fuse.h"
 
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <stdlib.h>
 
 
 namespace gridfs
 {
 
+  void*
+  init(struct fuse_conn_info* conn);
+
+  void
+  destroy(void* private_data);
+
   int
   getattr(const char *path, struct stat *stbuf);
 
@@ -38,6 +45,12 @@ namespace gridfs
   int
   unlink(const char * path);
 
+  int
+  rename(const char* oldpath, const char* newpath);
+
+  int
+  statfs(const char* path, struct statvfs* buf);
+
   int
   open(const char *path, 
 	  struct fuse_file_info *fileinfo);
@@ -8,15 +8,62 @@
 #include <libmemcached/util/pool.h>
 #include <libmemcached/memcached.h>
 #include <syslog.h>
+#include <sys/time.h>
+#include <fnmatch.h>
+#include <sstream>
+#include <algorithm>
+#include <set>
 
 #include "filesystem_operations.h"
 #include "filesystem_entry.h"
 #include "auth_hook.h"
+#include "attribute_cache.h"
+#include "listing_cache.h"
+#include "oplog_tailer.h"
+#include "namespace_index.h"
+#include "unlinker.h"
+#include "statistics.h"
+#include "cache_backend.h"
+#include "memcache_ring.h"
+#include "io_executor.h"
+#include "read_router.h"
+#include "memcache_value.h"
 
 
 namespace gridfs 
 {
   const unsigned int MONGO_DEFAULT_CHUNK_SIZE = 256 * 1024;
+  const unsigned int MONGO_DEFAULT_MIN_CHUNK_SIZE = 4 * 1024;
+  const unsigned int MONGO_DEFAULT_MAX_CHUNK_SIZE = 4 * 1024 * 1024;
+
+  // a chunk document must stay below mongo's 16 MB document limit
+  const unsigned int MONGO_MAX_CHUNK_SIZE = 15 * 1024 * 1024;
+
+  // files written with writes at least this large are considered
+  // to be streamed and may get chunks larger than mongo_chunk_size
+  const size_t STREAMING_WRITE_SIZE = 64 * 1024;
+
+  // chunks of streamed files are grown until a file has
+  // at most this many chunks (or mongo_max_chunk_size is reached)
+  const size_t TARGET_CHUNKS_PER_FILE = 64;
+
+  const unsigned int DEFAULT_ATTR_CACHE_SIZE = 64 * 1024;
+  const unsigned int DEFAULT_ATTR_CACHE_TTL = 1000;
+
+  const unsigned int DEFAULT_READDIR_BATCH_SIZE = 1000;
+
+  const unsigned int DEFAULT_LISTING_CACHE_SIZE = 1024;
+  const unsigned int DEFAULT_LISTING_CACHE_MAX_ENTRIES = 10000;
+
+  const unsigned int DEFAULT_NAMESPACE_INDEX_THREADS = 8;
+  const unsigned int DEFAULT_UNLINK_BATCH_SIZE = 1000;
+  const unsigned int DEFAULT_STATFS_INTERVAL = 30;
+  const unsigned int DEFAULT_LOCAL_CACHE_MB = 256;
+  const unsigned int DEFAULT_LOCAL_CACHE_TTL = 3600;
+  const unsigned int DEFAULT_MIGRATION_WINDOW = 600;
+  const unsigned int DEFAULT_IO_THREADS = 4;
+  const unsigned int DEFAULT_READAHEAD_CHUNKS = 2;
+  const unsigned int DEFAULT_MAX_STALENESS = 10;
 
   // options to configure gridfs
   // here: mapping to config struct
@@ -31,6 +78,33 @@ namespace gridfs
      GRIDFS_OPT("log_level=%s", log_level, 0),
      GRIDFS_OPT("default_uid=%u", default_uid, 0),
      GRIDFS_OPT("default_gid=%u", default_gid, 0),
+     GRIDFS_OPT("mongo_chunk_size=%u", mongo_chunk_size, 0),
+     GRIDFS_OPT("mongo_min_chunk_size=%u", mongo_min_chunk_size, 0),
+     GRIDFS_OPT("mongo_max_chunk_size=%u", mongo_max_chunk_size, 0),
+     GRIDFS_OPT("mongo_chunk_size_rules=%s", mongo_chunk_size_rules, 0),
+     GRIDFS_OPT("inline_threshold=%u", inline_threshold, 0),
+     GRIDFS_OPT("attr_cache_size=%u", attr_cache_size, 0),
+     GRIDFS_OPT("attr_cache_ttl=%u", attr_cache_ttl, 0),
+     GRIDFS_OPT("memcached_negative_ttl=%u", memcached_negative_ttl, 0),
+     GRIDFS_OPT("list_by_regex=%u", list_by_regex, 0),
+     GRIDFS_OPT("readdir_batch_size=%u", readdir_batch_size, 0),
+     GRIDFS_OPT("listing_cache_size=%u", listing_cache_size, 0),
+     GRIDFS_OPT("listing_cache_max_entries=%u", listing_cache_max_entries, 0),
+     GRIDFS_OPT("memcached_ttl=%u", memcached_ttl, 0),
+     GRIDFS_OPT("oplog_tail=%u", oplog_tail, 0),
+     GRIDFS_OPT("namespace_index=%u", namespace_index, 0),
+     GRIDFS_OPT("namespace_index_threads=%u", namespace_index_threads, 0),
+     GRIDFS_OPT("unlink_batch_size=%u", unlink_batch_size, 0),
+     GRIDFS_OPT("statfs_interval=%u", statfs_interval, 0),
+     GRIDFS_OPT("capacity_gb=%u", capacity_gb, 0),
+     GRIDFS_OPT("cache=%s", cache, 0),
+     GRIDFS_OPT("local_cache_mb=%u", local_cache_mb, 0),
+     GRIDFS_OPT("local_cache_ttl=%u", local_cache_ttl, 0),
+     GRIDFS_OPT("migration_window=%u", migration_window, 0),
+     GRIDFS_OPT("io_threads=%u", io_threads, 0),
+     GRIDFS_OPT("readahead_chunks=%u", readahead_chunks, 0),
+     GRIDFS_OPT("read_preference=%s", read_preference, 0),
+     GRIDFS_OPT("max_staleness=%u", max_staleness, 0),
 
      FUSE_OPT_KEY("-V",             KEY_VERSION),
      FUSE_OPT_KEY("-v",             KEY_VERSION),
@@ -72,7 +146,34 @@ namespace gridfs
         << "  -o path_prefix=STRING              this prefix will be prepended to all path stored in mongo (default: \"\")" << std::endl
         << "  -o log_level=STRING                logging level (EMERG, ALERT, CRIT, ERR, WARNING, NOTICE, INFO, DEBUG) (default: ERR)" << std::endl
         << "  -o default_uid=INT                 optional default user id (default: userid of user running gridfs)" << std::endl
-        << "  -o default_gid=INT                 optional default group id (default: groupid of user running gridfs)"
+        << "  -o default_gid=INT                 optional default group id (default: groupid of user running gridfs)" << std::endl
+        << "  -o mongo_chunk_size=INT            chunk size in bytes for regular files, also used as max_read/max_write (default: 262144)" << std::endl
+        << "  -o mongo_min_chunk_size=INT        smallest chunk size in bytes used for small files (default: 4096)" << std::endl
+        << "  -o mongo_max_chunk_size=INT        largest chunk size in bytes used for large streamed files (default: 4194304)" << std::endl
+        << "  -o mongo_chunk_size_rules=STRING   chunk sizes for matching paths (e.g. *.iso=4194304:*/logs/*=65536)" << std::endl
+        << "  -o inline_threshold=INT            files up to this size are stored inside their files document (default: 0, i.e. disabled)" << std::endl
+        << "  -o attr_cache_size=INT             number of attributes cached in-process in front of memcached (default: 65536, 0 disables it)" << std::endl
+        << "  -o attr_cache_ttl=INT              milliseconds an attribute is cached in-process (default: 1000)" << std::endl
+        << "  -o memcached_negative_ttl=INT      seconds nonexistent paths are cached in memcached (default: 0, i.e. only in-process)" << std::endl
+        << "  -o list_by_regex=INT               1 to list directories by filename instead of the parent field (default: 0, 1 if entries without parent field are found when mounting)" << std::endl
+        << "  -o readdir_batch_size=INT          number of directory entries fetched from mongo at once (default: 1000)" << std::endl
+        << "  -o listing_cache_size=INT          number of directory listings cached in-process (default: 1024)" << std::endl
+        << "  -o listing_cache_max_entries=INT   directories with more entries are never cached (default: 10000, 0 disables listing caching)" << std::endl
+        << "  -o memcached_ttl=INT               seconds attributes and listings are cached in memcached (default: 0, i.e. until evicted)" << std::endl
+        << "  -o oplog_tail=INT                  1 to evict entries changed by other mounts by tailing the oplog of the replica set (default: 0)" << std::endl
+        << "  -o namespace_index=INT             1 to keep the attributes of all entries in memory, best together with oplog_tail (default: 0)" << std::endl
+        << "  -o namespace_index_threads=INT     number of threads loading the namespace index (default: 8)" << std::endl
+        << "  -o unlink_batch_size=INT           number of unlinked files deleted from mongo at once in the background (default: 1000)" << std::endl
+        << "  -o statfs_interval=INT             seconds between reading the statistics reported by statfs (default: 30)" << std::endl
+        << "  -o capacity_gb=INT                 size of the filesystem reported by statfs (default: 0, i.e. the disks of mongo)" << std::endl
+        << "  -o cache=STRING                    where attributes and listings are cached besides in-process: memcached, local, tiered (local in front of memcached), or none (default: memcached)" << std::endl
+        << "  -o local_cache_mb=INT              megabytes of keys and values kept by the local and tiered cache (default: 256)" << std::endl
+        << "  -o local_cache_ttl=INT             seconds a value is kept by the local cache, e.g. listings of outdated generations (default: 3600, 0 for no limit)" << std::endl
+        << "  -o migration_window=INT            seconds keys are still read from the previous memcached servers after a server is added or removed (default: 600)" << std::endl
+        << "  -o io_threads=INT                  number of threads reading ahead and storing chunks in the background (default: 4, 0 disables both)" << std::endl
+        << "  -o readahead_chunks=INT            number of chunks fetched ahead of sequential reads (default: 2)" << std::endl
+        << "  -o read_preference=STRING          replica set members reading files and listings: primary, primaryPreferred, secondary, secondaryPreferred, or nearest (default: primary)" << std::endl
+        << "  -o max_staleness=INT               seconds secondaries may lag behind and changed paths are read from the primary (default: 10)"
         << std::endl << std::endl;
 
       fuse_opt_add_arg(outargs, "-ho");
@@ -134,6 +235,32 @@ namespace gridfs
     config.default_uid = getuid();
     config.default_gid = getgid();
     config.mongo_chunk_size = MONGO_DEFAULT_CHUNK_SIZE;
+    config.mongo_min_chunk_size = MONGO_DEFAULT_MIN_CHUNK_SIZE;
+    config.mongo_max_chunk_size = MONGO_DEFAULT_MAX_CHUNK_SIZE;
+    config.mongo_chunk_size_rules = (char*)"";
+    config.inline_threshold = 0;
+    config.attr_cache_size = DEFAULT_ATTR_CACHE_SIZE;
+    config.attr_cache_ttl = DEFAULT_ATTR_CACHE_TTL;
+    config.memcached_negative_ttl = 0;
+    config.list_by_regex = 0;
+    config.readdir_batch_size = DEFAULT_READDIR_BATCH_SIZE;
+    config.listing_cache_size = DEFAULT_LISTING_CACHE_SIZE;
+    config.listing_cache_max_entries = DEFAULT_LISTING_CACHE_MAX_ENTRIES;
+    config.memcached_ttl = 0;
+    config.oplog_tail = 0;
+    config.namespace_index = 0;
+    config.namespace_index_threads = DEFAULT_NAMESPACE_INDEX_THREADS;
+    config.unlink_batch_size = DEFAULT_UNLINK_BATCH_SIZE;
+    config.statfs_interval = DEFAULT_STATFS_INTERVAL;
+    config.capacity_gb = 0;
+    config.cache = (char*)"memcached";
+    config.local_cache_mb = DEFAULT_LOCAL_CACHE_MB;
+    config.local_cache_ttl = DEFAULT_LOCAL_CACHE_TTL;
+    config.migration_window = DEFAULT_MIGRATION_WINDOW;
+    config.io_threads = DEFAULT_IO_THREADS;
+    config.readahead_chunks = DEFAULT_READAHEAD_CHUNKS;
+    config.read_preference = (char*)"primary";
+    config.max_staleness = DEFAULT_MAX_STALENESS;
 
     // point filesystem operations to the right callback functions
     filesystem_operations.getattr    = gridfs::getattr;
@@ -154,6 +281,10 @@ namespace gridfs
     filesystem_operations.chown      = gridfs::chown;
     filesystem_operations.truncate   = gridfs::truncate;
     filesystem_operations.utimens    = gridfs::utimens;
+    filesystem_operations.init       = gridfs::init;
+    filesystem_operations.destroy    = gridfs::destroy;
+    filesystem_operations.rename     = gridfs::rename;
+    filesystem_operations.statfs     = gridfs::statfs;
 
     // get all commandline args
     args.argc = argc;
@@ -165,11 +296,27 @@ namespace gridfs
 
     initSyslog();
 
-    // check chunksize < 200 MB
-    if (config.mongo_chunk_size >= (200 * 1024 * 1024))
+    // check chunksizes fit into a mongo document
+    if (config.mongo_min_chunk_size == 0 ||
+        config.mongo_min_chunk_size > config.mongo_chunk_size ||
+        config.mongo_chunk_size > config.mongo_max_chunk_size ||
+        config.mongo_max_chunk_size > MONGO_MAX_CHUNK_SIZE)
     {
       std::cerr
-        << "chunk size is too high < 2GB (" << argv[0] << " -h)"
+        << "invalid chunk sizes, 0 < min <= chunk size <= max <= "
+        << MONGO_MAX_CHUNK_SIZE << " required (" << argv[0] << " -h)"
+        << std::endl;
+      exit(1);
+    }
+
+    initChunkSizeRules();
+
+    // inlined content has to fit into the files document
+    if (config.inline_threshold > MONGO_MAX_CHUNK_SIZE)
+    {
+      std::cerr
+        << "inline threshold is too high <= " << MONGO_MAX_CHUNK_SIZE
+        << " (" << argv[0] << " -h)"
         << std::endl;
       exit(1);
     }
@@ -202,9 +349,38 @@ namespace gridfs
       exit(1);
     }
     
-    theMaster = memcached_create(NULL);
-    theMemcachePool = memcached_pool_create(theMaster, 100, 200);
-    memcached_pool_behavior_set(theMemcachePool, MEMCACHED_BEHAVIOR_KETAMA, 1);
+    theRing = new MemcacheRing(config.migration_window);
+    mongo::ReadPreference lReadPreference;
+    if (!ReadRouter::parse(config.read_preference, lReadPreference))
+    {
+      std::cerr
+        << "unknown read preference " << config.read_preference << " (" << argv[0] << " -h)"
+        << std::endl;
+      exit(1);
+    }
+    if (lReadPreference != mongo::ReadPreference_PrimaryOnly)
+    {
+      // only replica sets have secondaries, the lag is checked
+      // once the thread runs (see startThreads)
+      if (connection_string().type() == mongo::ConnectionString::SET)
+        theReadRouter = new ReadRouter(lReadPreference, config.max_staleness);
+      else
+        syslog(LOG_WARNING, "read_preference ignored, %s isn't a replica set",
+            config.mongo_conn_string);
+    }
+
+    theCache = CacheBackend::create(config.cache);
+    if (!theCache)
+    {
+      std::cerr
+        << "unknown cache " << config.cache << " (" << argv[0] << " -h)"
+        << std::endl;
+      exit(1);
+    }
+
+    theAttributeCache = new AttributeCache(config.attr_cache_size, config.attr_cache_ttl);
+    theListingCache = new ListingCache(
+        config.listing_cache_max_entries ? config.listing_cache_size : 0);
 
     // enable mongo authentication if username given
     if (strcmp(config.mongo_user, "") != 0)
@@ -223,26 +399,128 @@ namespace gridfs
   void
   Fuse::createRootDir()
   {
+    // the directories of path_prefix might not exist either
     std::string lRootDir = config.path_prefix;
     gridfs::FilesystemEntry lEntry(lRootDir);
     if (!lEntry.exists())
     {
-      mode_t mode = S_IFDIR | 0755;
-      gridfs::mkdir("", mode);
+      lEntry.createDirectories(S_IFDIR | 0755, config.default_uid, config.default_gid);
+      Memcache m;
+      m.remove(lRootDir);
+    }
+  }
+
+  void
+  Fuse::checkParents()
+  {
+    if (config.list_by_regex)
+      return;
+
+    // documents written by older versions don't have the parent field
+    // yet, listing by it would hide them and let rmdir orphan them.
+    // Only the root has no parent otherwise (see parentPath).
+    static const mongo::BSONObj lFields = BSON("_id" << 1);
+    mongo::ScopedDbConnection lConnection(connection_string());
+    mongo::BSONObj lFile = lConnection->findOne(
+        MongoContext::filesCollection(),
+        BSON("parent" << BSON("$exists" << false) <<
+             "filename" << BSON("$regex" << "/")),
+        &lFields);
+    lConnection.done();
+
+    if (!lFile.isEmpty())
+    {
+      syslog(LOG_WARNING, "found entries without parent field, listing directories "
+          "by filename until gridfs-migrate parent has been run");
+      config.list_by_regex = 1;
+    }
+  }
+
+  void
+  Fuse::startThreads()
+  {
+    if (config.namespace_index)
+    {
+      theNamespaceIndex = new NamespaceIndex(config.namespace_index_threads);
+      theNamespaceIndex->reload();
+    }
+
+    if (config.oplog_tail)
+    {
+      theOplogTailer = new OplogTailer();
+      theOplogTailer->start();
+    }
+
+    theUnlinker = new Unlinker(std::max(config.unlink_batch_size, 1u));
+    theUnlinker->start();
+
+    theCache->start();
+
+    if (theReadRouter)
+      theReadRouter->start();
+
+    if (config.io_threads)
+    {
+      theIoExecutor = new IoExecutor(config.io_threads);
+      theIoExecutor->start();
     }
+
+    theStatistics = new Statistics(
+        std::max(config.statfs_interval, 1u),
+        (unsigned long long)config.capacity_gb << 30);
+    theStatistics->start();
+  }
+
+  void
+  Fuse::stopThreads()
+  {
+    delete theIoExecutor;
+    theIoExecutor = 0;
+
+    delete theReadRouter;
+    theReadRouter = 0;
+
+    // the tailer refreshes the index
+    delete theOplogTailer;
+    theOplogTailer = 0;
+
+    delete theNamespaceIndex;
+    theNamespaceIndex = 0;
+
+    delete theUnlinker;
+    theUnlinker = 0;
+
+    delete theStatistics;
+    theStatistics = 0;
+
+    // the others might have queued writes
+    if (theCache)
+      theCache->stop();
   }
 
   Fuse::Fuse()
-    : theMemcachePool(0),
-      theMaster(0),
-      theServers(0)
+    : theRing(0),
+      theServers(0),
+      theAttributeCache(0),
+      theListingCache(0),
+      theOplogTailer(0),
+      theNamespaceIndex(0),
+      theUnlinker(0),
+      theStatistics(0),
+      theCache(0),
+      theIoExecutor(0),
+      theReadRouter(0)
   {
   }
 
   Fuse::~Fuse()
   {
-    if (theMemcachePool) memcached_pool_destroy(theMemcachePool);
-    if (theMaster) memcached_free(theMaster);
+    stopThreads();
+
+    delete theCache;
+    delete theRing;
+    delete theAttributeCache;
+    delete theListingCache;
 
     fuse_opt_free_args(&args);
 
@@ -268,74 +546,437 @@ namespace gridfs
     return lConString;
   }
 
-  memcached_st*
-  Fuse::cache()
+  void
+  Fuse::initChunkSizeRules()
   {
-    memcached_return rc;
-    memcached_st* m = memcached_pool_pop(theMemcachePool, true, &rc);
-    return m;
+    // rules are given as "pattern=size:pattern=size"
+    std::istringstream lRules(config.mongo_chunk_size_rules);
+    std::string lRule;
+    while (std::getline(lRules, lRule, ':'))
+    {
+      if (lRule.empty())
+        continue;
+
+      size_t lIndexOfEquals = lRule.find_last_of('=');
+      unsigned int lSize = 0;
+      if (lIndexOfEquals != std::string::npos)
+        lSize = strtoul(lRule.c_str() + lIndexOfEquals + 1, NULL, 10);
+
+      if (lSize == 0 || lSize > MONGO_MAX_CHUNK_SIZE)
+      {
+        std::cerr
+          << "invalid chunk size rule " << lRule
+          << " (" << args.argv[0] << " -h)" << std::endl;
+        exit(1);
+      }
+
+      theChunkSizeRules.push_back(
+          ChunkSizeRule(lRule.substr(0, lIndexOfEquals), lSize));
+    }
   }
 
-  void
-  Fuse::release(memcached_st* m)
+  /**
+   * the chunk size is chosen per file when it is stored. Readers use the
+   * chunkSize of each files document, hence it can be different for
+   * every file (or even every version of a file).
+   *
+   * 1) the first path rule matching the path wins
+   * 2) files smaller than mongo_chunk_size get a single chunk rounded
+   *    up to the next power of two (at least mongo_min_chunk_size)
+   * 3) large files written with big writes (i.e. streamed) get chunks
+   *    up to mongo_max_chunk_size to keep the number of chunks low
+   * 4) all other files use mongo_chunk_size
+   */
+  unsigned int
+  Fuse::chunkSize(const std::string& aPath, size_t aLength, size_t aMaxWrite) const
   {
-    memcached_pool_push(theMemcachePool, m);
+    for (std::vector<ChunkSizeRule>::const_iterator lIt = theChunkSizeRules.begin();
+         lIt != theChunkSizeRules.end();
+         ++lIt)
+    {
+      if (fnmatch(lIt->first.c_str(), aPath.c_str(), 0) == 0)
+        return lIt->second;
+    }
+
+    unsigned int lChunkSize = config.mongo_chunk_size;
+
+    if (aLength < lChunkSize)
+    {
+      unsigned int lSmallChunkSize = config.mongo_min_chunk_size;
+      while (lSmallChunkSize < aLength)
+        lSmallChunkSize <<= 1;
+      return std::min(lSmallChunkSize, lChunkSize);
+    }
+
+    if (aMaxWrite >= STREAMING_WRITE_SIZE)
+    {
+      while (lChunkSize < config.mongo_max_chunk_size &&
+             aLength / lChunkSize > TARGET_CHUNKS_PER_FILE)
+        lChunkSize <<= 1;
+      lChunkSize = std::min(lChunkSize, config.mongo_max_chunk_size);
+    }
+
+    return lChunkSize;
   }
 
   Fuse FUSE;
 
-  Memcache::Memcache()
-    : m(FUSE.cache())
+  Memcache::Memcache(bool aShared)
+    : theShared(aShared)
   {}
 
   Memcache::~Memcache()
+  {}
+
+  // the kinds of attribute values
+  static const uint8_t MEMCACHED_MISSING = 0;
+  static const uint8_t MEMCACHED_EXISTS  = 1;
+
+  // listings are split into values of at most this size
+  // (memcached's default item size limit is 1MB)
+  static const size_t MEMCACHED_MAX_LISTING_PART = 512 * 1024;
+
+  Memcache::Result
+  Memcache::get(const std::string& aPath, struct stat* aBuf)
   {
-    FUSE.release(m);
+    bool lExists;
+    if (FUSE.attributes()->get(aPath, aBuf, lExists))
+      return lExists ? EXISTS : MISSING;
+
+    std::string lTarget;
+    return fetch(aPath, aBuf, lTarget);
   }
 
-  bool
-  Memcache::get(const std::string& aPath, struct stat* aBuf)
+  Memcache::Result
+  Memcache::fetch(const std::string& aPath, struct stat* aBuf, std::string& aTarget)
   {
-    uint32_t lFlags = 0;
-    size_t lLength  = 0;
-    memcached_return_t rc;
+    std::string lKey = memcache_key('a', aPath);
+
+    // the backend still has what's about to be deleted
+    if (FUSE.cache()->pending(lKey))
+      return UNKNOWN;
 
-    std::string lKey = "a:" + aPath;
+    std::string lValue;
+    if (!FUSE.cache()->get(lKey, lValue))
+      return UNKNOWN;
 
-    char* lResult = memcached_get(m, lKey.c_str(), lKey.size(), &lLength, &lFlags, &rc); 
+    return decode(aPath, lValue.data(), lValue.size(), aBuf, aTarget);
+  }
 
-    if (lResult)
+  Memcache::Result
+  Memcache::decode(
+      const std::string& aPath,
+      const char* aValue,
+      size_t aLength,
+      struct stat* aBuf,
+      std::string& aTarget)
+  {
+    ValueDecoder lDecoder(aValue, aLength, aPath);
+    uint8_t lKind = lDecoder.getByte();
+    if (lKind == MEMCACHED_EXISTS)
     {
-      assert(lLength == sizeof(struct stat));
-      memcpy(aBuf, lResult, sizeof(struct stat));
-      free(lResult);
-      return true;
+      // the attributes, followed by the target for symbolic links
+      lDecoder.getStat(aBuf);
+      aTarget = lDecoder.getRaw();
     }
-    else
+
+    if (!lDecoder.valid())
+      return UNKNOWN;
+
+    if (lKind == MEMCACHED_MISSING)
     {
-      return false;
+      FUSE.attributes()->setMissing(aPath);
+      return MISSING;
+    }
+
+    FUSE.attributes()->set(aPath, aBuf, aTarget);
+    return EXISTS;
+  }
+
+  bool
+  Memcache::getTarget(const std::string& aPath, std::string& aTarget)
+  {
+    if (FUSE.attributes()->getTarget(aPath, aTarget))
+      return true;
+
+    // only symbolic links have a target after their attributes
+    struct stat lStat;
+    return fetch(aPath, &lStat, aTarget) == EXISTS && !aTarget.empty();
+  }
+
+  void
+  Memcache::set(
+      const std::string& aPath,
+      struct stat* aBuf,
+      const std::string& aTarget)
+  {
+    FUSE.attributes()->set(aPath, aBuf, aTarget);
+    if (!theShared)
+      return;
+
+    ValueEncoder lValue(aPath);
+    lValue.putByte(MEMCACHED_EXISTS);
+    lValue.putStat(aBuf);
+    lValue.putRaw(aTarget);
+
+    FUSE.cache()->set(memcache_key('a', aPath), lValue.value(), FUSE.config.memcached_ttl);
+  }
+
+  void
+  Memcache::set(const Attributes& aAttributes)
+  {
+    for (Attributes::const_iterator lIt = aAttributes.begin();
+         lIt != aAttributes.end();
+         ++lIt)
+    {
+      FUSE.attributes()->set(lIt->first, &lIt->second);
+      if (!theShared)
+        continue;
+
+      ValueEncoder lValue(lIt->first);
+      lValue.putByte(MEMCACHED_EXISTS);
+      lValue.putStat(&lIt->second);
+
+      // queued and sent together
+      FUSE.cache()->set(memcache_key('a', lIt->first), lValue.value(), FUSE.config.memcached_ttl);
     }
   }
 
   void
-  Memcache::set(const std::string& aPath, struct stat* aBuf)
+  Memcache::setMissing(const std::string& aPath)
   {
-    uint32_t lFlags = 0;
-    memcached_return_t rc;
+    FUSE.attributes()->setMissing(aPath);
 
-    std::string lKey = "a:" + aPath;
+    // negative entries expire because mounts which don't share
+    // this memcached can create the path without removing them
+    if (FUSE.config.memcached_negative_ttl == 0 || !theShared)
+      return;
 
-    rc = memcached_set(m, lKey.c_str(), lKey.size(), (const char*) aBuf, sizeof(struct stat), 0, lFlags);
+    ValueEncoder lValue(aPath);
+    lValue.putByte(MEMCACHED_MISSING);
+
+    FUSE.cache()->set(memcache_key('a', aPath), lValue.value(), FUSE.config.memcached_negative_ttl);
   }
 
   void
   Memcache::remove(const std::string& aPath)
   {
-    memcached_return_t rc;
+    invalidate(aPath);
+
+    NamespaceIndex* lIndex = FUSE.namespaceIndex();
+    if (lIndex)
+    {
+      try
+      {
+        lIndex->refresh(aPath);
+      }
+      catch (std::exception& e)
+      {
+        // the change itself succeeded, just don't trust the index anymore
+        syslog(LOG_ERR, "remove: refreshing namespace index for %s failed: %s",
+            aPath.c_str(), e.what());
+        lIndex->reload();
+      }
+    }
+  }
+
+  void
+  Memcache::invalidate(const std::string& aPath)
+  {
+    FUSE.attributes()->remove(aPath);
+    FUSE.cache()->remove(memcache_key('a', aPath));
 
-    std::string lKey = "a:" + aPath;
+    std::string lDir;
+    if (FilesystemEntry::parentPath(aPath, lDir))
+      bumpGeneration(lDir);
+  }
+
+  void
+  Memcache::invalidate(const std::vector<std::string>& aPaths)
+  {
+    std::set<std::string> lDirs;
+    for (std::vector<std::string>::const_iterator lIt = aPaths.begin();
+         lIt != aPaths.end();
+         ++lIt)
+    {
+      FUSE.attributes()->remove(*lIt);
+      FUSE.cache()->remove(memcache_key('a', *lIt));
+
+      std::string lDir;
+      if (FilesystemEntry::parentPath(*lIt, lDir))
+        lDirs.insert(lDir);
+    }
+
+    // every directory only once
+    for (std::set<std::string>::const_iterator lIt = lDirs.begin();
+         lIt != lDirs.end();
+         ++lIt)
+    {
+      bumpGeneration(*lIt);
+    }
+  }
 
-    rc = memcached_delete(m, lKey.c_str(), lKey.size(), 0);
+  std::string
+  Memcache::generation(const std::string& aDir)
+  {
+    if (FUSE.config.listing_cache_max_entries == 0)
+      return "";
+
+    // the generation is about to change
+    std::string lKey = memcache_key('g', aDir);
+    if (FUSE.cache()->pending(lKey))
+      return "";
+
+    std::string lGeneration;
+    if (!FUSE.cache()->get(lKey, lGeneration))
+    {
+      // start with the current time such that a directory whose
+      // generation has been evicted doesn't get an old one again
+      struct timeval lNow;
+      gettimeofday(&lNow, NULL);
+      std::ostringstream lInitial;
+      lInitial << (unsigned long long)lNow.tv_sec * 1000000 + lNow.tv_usec;
+
+      // another mount might have been faster
+      FUSE.cache()->add(lKey, lInitial.str(), 0);
+      if (!FUSE.cache()->get(lKey, lGeneration))
+        return "";
+    }
+    return lGeneration;
+  }
+
+  void
+  Memcache::bumpGeneration(const std::string& aDir)
+  {
+    if (FUSE.config.listing_cache_max_entries == 0)
+      return;
+
+    FUSE.listings()->remove(aDir);
+
+    // nothing to do if it doesn't exist, no listing can be cached
+    // for a generation that's yet to be created
+    FUSE.cache()->increment(memcache_key('g', aDir));
+  }
+
+  // the key of a part of a listing
+  static std::string
+  listing_key(const std::string& aDir, const std::string& aGeneration, uint32_t aPart)
+  {
+    std::ostringstream lKey;
+    lKey << memcache_key('l', aDir) << ":" << aGeneration << ":" << aPart;
+    return lKey.str();
+  }
+
+  Memcache::Listing
+  Memcache::getListing(const std::string& aDir, const std::string& aGeneration)
+  {
+    if (aGeneration.empty())
+      return Listing();
+
+    Listing lListing = FUSE.listings()->get(aDir, aGeneration);
+    if (lListing)
+      return lListing;
+
+    // the first part knows the number of parts
+    std::string lValue;
+    if (!FUSE.cache()->get(listing_key(aDir, aGeneration, 0), lValue))
+      return Listing();
+
+    std::string lEntries;
+    uint32_t lParts;
+    {
+      ValueDecoder lDecoder(lValue.data(), lValue.size(), aDir);
+      lParts = lDecoder.getInt();
+      lEntries = lDecoder.getRaw();
+      if (!lDecoder.valid())
+        return Listing();
+    }
+
+    if (lParts > 1)
+    {
+      std::vector<std::string> lKeys;
+      for (uint32_t i = 1; i < lParts; ++i)
+        lKeys.push_back(listing_key(aDir, aGeneration, i));
+
+      // the others at once, missing ones are empty
+      std::vector<std::string> lValues;
+      FUSE.cache()->get(lKeys, lValues);
+      if (lValues.size() != lKeys.size())
+        return Listing();
+
+      // all of them or nothing
+      for (size_t i = 0; i < lValues.size(); ++i)
+      {
+        ValueDecoder lDecoder(lValues[i].data(), lValues[i].size(), aDir);
+        uint32_t lPart = lDecoder.getInt();
+        std::string lPartEntries = lDecoder.getRaw();
+        if (lValues[i].empty() || !lDecoder.valid() || lPart != i + 1)
+          return Listing();
+        lEntries.append(lPartEntries);
+      }
+    }
+
+    // sequence of (name, attributes)
+    Attributes* lAttributes = new Attributes();
+    lListing.reset(lAttributes);
+
+    ValueDecoder lDecoder(lEntries.data(), lEntries.size());
+    while (lDecoder.valid() && !lDecoder.atEnd())
+    {
+      std::string lName = lDecoder.getString();
+      struct stat lStat;
+      lDecoder.getStat(&lStat);
+      lAttributes->push_back(std::make_pair(lName, lStat));
+    }
+
+    if (!lDecoder.valid())
+    {
+      syslog(LOG_ERR, "getListing: corrupt listing of %s", aDir.c_str());
+      return Listing();
+    }
+
+    FUSE.listings()->set(aDir, aGeneration, lListing);
+    return lListing;
+  }
+
+  void
+  Memcache::setListing(
+      const std::string& aDir,
+      const std::string& aGeneration,
+      const Listing& aListing)
+  {
+    // a listing cached in-process isn't read again before the
+    // generation changes either
+    if (aGeneration.empty() || !theShared)
+      return;
+
+    FUSE.listings()->set(aDir, aGeneration, aListing);
+
+    // sequence of (name, attributes) split into parts
+    std::vector<std::string> lParts(1);
+    for (Attributes::const_iterator lIt = aListing->begin();
+         lIt != aListing->end();
+         ++lIt)
+    {
+      ValueEncoder lEntry;
+      lEntry.putString(lIt->first);
+      lEntry.putStat(&lIt->second);
+
+      if (lParts.back().size() > MEMCACHED_MAX_LISTING_PART)
+        lParts.push_back(std::string());
+      lParts.back().append(lEntry.value());
+    }
+
+    // listings of previous generations are never read again
+    // and left to memcached's eviction
+    for (uint32_t i = 0; i < lParts.size(); ++i)
+    {
+      ValueEncoder lValue(aDir);
+      lValue.putInt(i == 0 ? lParts.size() : i);
+      lValue.putRaw(lParts[i]);
+      FUSE.cache()->set(
+          listing_key(aDir, aGeneration, i), lValue.value(), FUSE.config.memcached_ttl);
+    }
   }
 
 }
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "io_executor.h"
+
+#include <syslog.h>
+#include <exception>
+
+#include "mongo_context.h"
+#include "lock.h"
+
+namespace gridfs {
+
+  IoRequest::IoRequest()
+    : theDone(false)
+  {
+    pthread_mutex_init(&theMutex, NULL);
+    pthread_cond_init(&theCondition, NULL);
+  }
+
+  IoRequest::~IoRequest()
+  {
+    pthread_cond_destroy(&theCondition);
+    pthread_mutex_destroy(&theMutex);
+  }
+
+  bool
+  IoRequest::wait()
+  {
+    gridfs::Lock lLock(theMutex);
+    while (!theDone)
+      pthread_cond_wait(&theCondition, &theMutex);
+    return theError.empty();
+  }
+
+  void
+  IoRequest::complete(const std::string& aError)
+  {
+    gridfs::Lock lLock(theMutex);
+    theError = aError;
+    theDone = true;
+    pthread_cond_broadcast(&theCondition);
+  }
+
+  IoExecutor::IoExecutor(unsigned int aThreads)
+    : theStarted(false)
+  {
+    for (unsigned int i = 0; i < aThreads; ++i)
+    {
+      Queue* lQueue = new Queue();
+      lQueue->theStarted = false;
+      lQueue->theStopped = false;
+      pthread_mutex_init(&lQueue->theMutex, NULL);
+      pthread_cond_init(&lQueue->theCondition, NULL);
+      theQueues.push_back(lQueue);
+    }
+  }
+
+  IoExecutor::~IoExecutor()
+  {
+    stop();
+    for (std::vector<Queue*>::iterator lIt = theQueues.begin();
+         lIt != theQueues.end();
+         ++lIt)
+    {
+      pthread_cond_destroy(&(*lIt)->theCondition);
+      pthread_mutex_destroy(&(*lIt)->theMutex);
+      delete *lIt;
+    }
+  }
+
+  void
+  IoExecutor::start()
+  {
+    for (std::vector<Queue*>::iterator lIt = theQueues.begin();
+         lIt != theQueues.end();
+         ++lIt)
+    {
+      (*lIt)->theStopped = false;
+      if (pthread_create(&(*lIt)->theThread, NULL, run, *lIt) != 0)
+      {
+        syslog(LOG_ERR, "io: couldn't start thread");
+        continue;
+      }
+      (*lIt)->theStarted = true;
+      theStarted = true;
+    }
+  }
+
+  void
+  IoExecutor::stop()
+  {
+    if (!theStarted)
+      return;
+
+    for (std::vector<Queue*>::iterator lIt = theQueues.begin();
+         lIt != theQueues.end();
+         ++lIt)
+    {
+      gridfs::Lock lLock((*lIt)->theMutex);
+      (*lIt)->theStopped = true;
+      pthread_cond_signal(&(*lIt)->theCondition);
+    }
+
+    for (std::vector<Queue*>::iterator lIt = theQueues.begin();
+         lIt != theQueues.end();
+         ++lIt)
+    {
+      if ((*lIt)->theStarted)
+        pthread_join((*lIt)->theThread, NULL);
+      (*lIt)->theStarted = false;
+    }
+    theStarted = false;
+  }
+
+  void
+  IoExecutor::submit(const IoRequestPtr& aRequest, size_t aAffinity)
+  {
+    Queue* lQueue = theQueues.empty() ? 0 : theQueues[aAffinity % theQueues.size()];
+    if (!lQueue || !lQueue->theStarted)
+    {
+      run(aRequest, std::vector<IoRequestPtr>());
+      return;
+    }
+
+    gridfs::Lock lLock(lQueue->theMutex);
+    lQueue->theRequests.push_back(aRequest);
+    pthread_cond_signal(&lQueue->theCondition);
+  }
+
+  void*
+  IoExecutor::run(void* aQueue)
+  {
+    loop(*static_cast<Queue*>(aQueue));
+    return NULL;
+  }
+
+  void
+  IoExecutor::loop(Queue& aQueue)
+  {
+    std::deque<IoRequestPtr> lRequests;
+    while (true)
+    {
+      {
+        gridfs::Lock lLock(aQueue.theMutex);
+
+        while (aQueue.theRequests.empty() && !aQueue.theStopped)
+          pthread_cond_wait(&aQueue.theCondition, &aQueue.theMutex);
+
+        if (aQueue.theRequests.empty())
+          return;
+
+        lRequests.swap(aQueue.theRequests);
+      }
+
+      // everything queued in the meantime, back to back ones are merged
+      while (!lRequests.empty())
+      {
+        IoRequestPtr lRequest = lRequests.front();
+        lRequests.pop_front();
+
+        std::vector<IoRequestPtr> lMerged;
+        while (!lRequests.empty() && lRequest->merge(*lRequests.front()))
+        {
+          lMerged.push_back(lRequests.front());
+          lRequests.pop_front();
+        }
+
+        run(lRequest, lMerged);
+      }
+    }
+  }
+
+  void
+  IoExecutor::run(const IoRequestPtr& aRequest, const std::vector<IoRequestPtr>& aMerged)
+  {
+    std::string lError;
+    try
+    {
+      aRequest->run(MongoContext::get());
+    }
+    catch (std::exception& e)
+    {
+      lError = e.what();
+      if (lError.empty())
+        lError = "unknown error";
+    }
+    catch (...)
+    {
+      lError = "unknown exception";
+    }
+
+    if (!lError.empty())
+      syslog(LOG_ERR, "io: request failed: %s", lError.c_str());
+
+    aRequest->complete(lError);
+    for (std::vector<IoRequestPtr>::const_iterator lIt = aMerged.begin();
+         lIt != aMerged.end();
+         ++lIt)
+      (*lIt)->complete(lError);
+  }
+
+}
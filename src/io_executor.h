@@ -0,0 +1,128 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+namespace gridfs {
+
+  class MongoContext;
+
+  /**
+   * an operation on mongo run by the IoExecutor. The submitter keeps a
+   * reference and waits for it once it needs the result, i.e. a fuse
+   * thread can have many of them outstanding.
+   */
+  class IoRequest
+  {
+    public:
+      IoRequest();
+
+      virtual
+      ~IoRequest();
+
+      // blocks until the request has been run, false if it failed
+      bool
+      wait();
+
+      const std::string&
+      error() const { return theError; }
+
+    protected:
+      friend class IoExecutor;
+
+      virtual void
+      run(MongoContext& aContext) = 0;
+
+      // takes over aOther, which has been queued right after this one,
+      // such that a single operation serves both (e.g. one query for
+      // several chunks), false if they can't be combined
+      virtual bool
+      merge(IoRequest& aOther) { return false; }
+
+      void
+      complete(const std::string& aError);
+
+    private:
+      // forbid copying
+      IoRequest(const IoRequest&);
+      IoRequest& operator=(const IoRequest&);
+
+      pthread_mutex_t theMutex;
+      pthread_cond_t  theCondition;
+      bool            theDone;
+      std::string     theError;
+  };
+
+  typedef boost::shared_ptr<IoRequest> IoRequestPtr;
+
+  /**
+   * a small set of threads running IoRequests, each with its own queue
+   * and its own mongo connection (see MongoContext). Requests with the
+   * same affinity go to the same thread and are run in order, and
+   * requests queued back to back are merged if possible (see
+   * IoRequest::merge).
+   *
+   * Used for reading ahead the chunks of files which are read
+   * sequentially (see File::read) and for inserting the chunks of large
+   * files over several connections at once (see
+   * FilesystemEntry::storeFile).
+   */
+  class IoExecutor
+  {
+    public:
+      IoExecutor(unsigned int aThreads);
+
+      ~IoExecutor();
+
+      void
+      start();
+
+      // runs what's queued and stops
+      void
+      stop();
+
+      unsigned int
+      threads() const { return theQueues.size(); }
+
+      // run in the calling thread if the executor isn't started
+      void
+      submit(const IoRequestPtr& aRequest, size_t aAffinity);
+
+    private:
+      struct Queue
+      {
+        pthread_t                theThread;
+        bool                     theStarted;
+
+        // protect the following members
+        pthread_mutex_t          theMutex;
+        pthread_cond_t           theCondition;
+        bool                     theStopped;
+        std::deque<IoRequestPtr> theRequests;
+      };
+
+      static void*
+      run(void* aQueue);
+
+      static void
+      loop(Queue& aQueue);
+
+      // runs aRequest together with the requests it merged
+      static void
+      run(const IoRequestPtr& aRequest, const std::vector<IoRequestPtr>& aMerged);
+
+      // forbid copying
+      IoExecutor(const IoExecutor&);
+      IoExecutor& operator=(const IoExecutor&);
+
+      std::vector<Queue*> theQueues;
+      bool                theStarted;
+  };
+
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "listing_cache.h"
+
+#include "lock.h"
+
+namespace gridfs {
+
+  ListingCache::ListingCache(size_t aMaxEntries)
+    : theMaxEntries(aMaxEntries)
+  {
+    pthread_mutex_init(&theMutex, NULL);
+  }
+
+  ListingCache::~ListingCache()
+  {
+    pthread_mutex_destroy(&theMutex);
+  }
+
+  Memcache::Listing
+  ListingCache::get(const std::string& aDir, const std::string& aGeneration)
+  {
+    if (!enabled())
+      return Memcache::Listing();
+
+    gridfs::Lock lLock(theMutex);
+
+    Entries::const_iterator lIt = theEntries.find(aDir);
+    if (lIt == theEntries.end() || lIt->second.theGeneration != aGeneration)
+      return Memcache::Listing();
+
+    return lIt->second.theListing;
+  }
+
+  void
+  ListingCache::set(
+      const std::string& aDir,
+      const std::string& aGeneration,
+      const Memcache::Listing& aListing)
+  {
+    if (!enabled())
+      return;
+
+    gridfs::Lock lLock(theMutex);
+
+    // listings are only replaced after their directory changed,
+    // so any entry is as good to drop as another one
+    if (theEntries.size() >= theMaxEntries &&
+        theEntries.find(aDir) == theEntries.end())
+      theEntries.erase(theEntries.begin());
+
+    Entry& lEntry = theEntries[aDir];
+    lEntry.theGeneration = aGeneration;
+    lEntry.theListing = aListing;
+  }
+
+  void
+  ListingCache::remove(const std::string& aDir)
+  {
+    if (!enabled())
+      return;
+
+    gridfs::Lock lLock(theMutex);
+    theEntries.erase(aDir);
+  }
+
+  void
+  ListingCache::clear()
+  {
+    gridfs::Lock lLock(theMutex);
+    theEntries.clear();
+  }
+
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <string>
+#include <boost/unordered_map.hpp>
+
+#include "gridfs_fuse.h"
+
+namespace gridfs {
+
+  /**
+   * in-process cache of directory listings which is consulted before
+   * memcached.
+   *
+   * Every listing is stored together with the generation of its
+   * directory it was read at (see Memcache::generation) and is only
+   * returned for the very same generation. Hence, entries don't need to
+   * expire, they become unreachable as soon as the directory changes.
+   */
+  class ListingCache
+  {
+    public:
+      ListingCache(size_t aMaxEntries);
+
+      ~ListingCache();
+
+      // the listing of aDir at aGeneration, null if not cached
+      Memcache::Listing
+      get(const std::string& aDir, const std::string& aGeneration);
+
+      void
+      set(
+          const std::string& aDir,
+          const std::string& aGeneration,
+          const Memcache::Listing& aListing);
+
+      void
+      remove(const std::string& aDir);
+
+      void
+      clear();
+
+      bool
+      enabled() const { return theMaxEntries != 0; }
+
+    private:
+      struct Entry
+      {
+        std::string       theGeneration;
+        Memcache::Listing theListing;
+      };
+
+      typedef boost::unordered_map<std::string, Entry> Entries;
+
+      // forbid copying
+      ListingCache(const ListingCache&);
+      ListingCache& operator=(const ListingCache&);
+
+      pthread_mutex_t theMutex;
+      Entries         theEntries;
+      size_t          theMaxEntries;
+  };
+
+}
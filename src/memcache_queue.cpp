@@ -0,0 +1,256 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "memcache_queue.h"
+
+#include <syslog.h>
+#include <libmemcached/memcached.h>
+
+#include "gridfs_fuse.h"
+#include "memcache_ring.h"
+#include "lock.h"
+
+namespace gridfs {
+
+  // sets are dropped once the queued operations need more memory
+  static const size_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+  // bookkeeping of an operation besides key and value
+  static const size_t OP_OVERHEAD = 64;
+
+  MemcacheQueue::MemcacheQueue()
+    : theStarted(false),
+      theConnection(0),
+      thePrevious(0),
+      theVersion(0),
+      theStopped(false),
+      theQueuedBytes(0),
+      theDropped(0)
+  {
+    pthread_mutex_init(&theMutex, NULL);
+    pthread_cond_init(&theCondition, NULL);
+  }
+
+  MemcacheQueue::~MemcacheQueue()
+  {
+    stop();
+    if (theConnection)
+      memcached_free(theConnection);
+    if (thePrevious)
+      memcached_free(thePrevious);
+    pthread_cond_destroy(&theCondition);
+    pthread_mutex_destroy(&theMutex);
+  }
+
+  void
+  MemcacheQueue::start()
+  {
+    theStopped = false;
+    if (pthread_create(&theThread, NULL, run, this) != 0)
+    {
+      syslog(LOG_ERR, "memcached: couldn't start writer thread");
+      return;
+    }
+    theStarted = true;
+  }
+
+  void
+  MemcacheQueue::stop()
+  {
+    if (!theStarted)
+      return;
+
+    {
+      gridfs::Lock lLock(theMutex);
+      theStopped = true;
+      pthread_cond_signal(&theCondition);
+    }
+    pthread_join(theThread, NULL);
+    theStarted = false;
+  }
+
+  void
+  MemcacheQueue::set(const std::string& aKey, const std::string& aValue, time_t aTTL)
+  {
+    Op lOp;
+    lOp.theType = Op::SET;
+    lOp.theKey = aKey;
+    lOp.theValue = aValue;
+    lOp.theTTL = aTTL;
+    push(lOp);
+  }
+
+  void
+  MemcacheQueue::remove(const std::string& aKey)
+  {
+    Op lOp;
+    lOp.theType = Op::REMOVE;
+    lOp.theKey = aKey;
+    lOp.theTTL = 0;
+    push(lOp);
+  }
+
+  void
+  MemcacheQueue::increment(const std::string& aKey)
+  {
+    Op lOp;
+    lOp.theType = Op::INCREMENT;
+    lOp.theKey = aKey;
+    lOp.theTTL = 0;
+    push(lOp);
+  }
+
+  bool
+  MemcacheQueue::pending(const std::string& aKey)
+  {
+    gridfs::Lock lLock(theMutex);
+    return thePending.find(aKey) != thePending.end();
+  }
+
+  void
+  MemcacheQueue::push(const Op& aOp)
+  {
+    size_t lSize = aOp.theKey.size() + aOp.theValue.size() + OP_OVERHEAD;
+
+    gridfs::Lock lLock(theMutex);
+    if (aOp.theType == Op::SET)
+    {
+      // the value is read from mongo again instead, whereas a lost
+      // invalidation would leave a stale value behind
+      if (theQueuedBytes + lSize > MAX_QUEUED_BYTES)
+      {
+        if (theDropped++ == 0)
+          syslog(LOG_WARNING, "memcached: writer can't keep up, dropping sets");
+        return;
+      }
+    }
+    else
+      ++thePending[aOp.theKey];
+    theOps.push_back(aOp);
+    theQueuedBytes += lSize;
+    pthread_cond_signal(&theCondition);
+  }
+
+  void*
+  MemcacheQueue::run(void* aQueue)
+  {
+    static_cast<MemcacheQueue*>(aQueue)->loop();
+    return NULL;
+  }
+
+  void
+  MemcacheQueue::loop()
+  {
+    std::deque<Op> lOps;
+    while (true)
+    {
+      {
+        gridfs::Lock lLock(theMutex);
+
+        // the previous batch has been sent
+        for (std::deque<Op>::const_iterator lIt = lOps.begin(); lIt != lOps.end(); ++lIt)
+        {
+          if (lIt->theType == Op::SET)
+            continue;
+          Pending::iterator lPending = thePending.find(lIt->theKey);
+          if (lPending != thePending.end() && --lPending->second == 0)
+            thePending.erase(lPending);
+        }
+        lOps.clear();
+
+        while (theOps.empty() && !theStopped)
+          pthread_cond_wait(&theCondition, &theMutex);
+
+        if (theOps.empty())
+          return;
+
+        if (theDropped)
+        {
+          syslog(LOG_WARNING, "memcached: dropped %lu sets", theDropped);
+          theDropped = 0;
+        }
+
+        lOps.swap(theOps);
+        theQueuedBytes = 0;
+      }
+
+      send(lOps);
+    }
+  }
+
+  // a connection for writes only, nothing is waited for
+  static memcached_st*
+  writer(memcached_st* aConnection)
+  {
+    if (aConnection)
+    {
+      memcached_behavior_set(aConnection, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+      memcached_behavior_set(aConnection, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+      memcached_behavior_set(aConnection, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+    }
+    return aConnection;
+  }
+
+  void
+  MemcacheQueue::send(const std::deque<Op>& aOps)
+  {
+    // servers might have been added or removed through proc in the meantime
+    MemcacheRing* lRing = FUSE.ring();
+    unsigned int lVersion = lRing->version();
+    if (!theConnection || lVersion != theVersion)
+    {
+      if (theConnection)
+        memcached_free(theConnection);
+      if (thePrevious)
+        memcached_free(thePrevious);
+
+      theConnection = writer(lRing->clone(false));
+      thePrevious = writer(lRing->clone(true));
+      theVersion = lVersion;
+    }
+    else if (thePrevious && !lRing->migrating())
+    {
+      memcached_free(thePrevious);
+      thePrevious = 0;
+    }
+
+    send(theConnection, aOps);
+    if (thePrevious)
+      send(thePrevious, aOps);
+  }
+
+  void
+  MemcacheQueue::send(memcached_st* aConnection, const std::deque<Op>& aOps)
+  {
+    if (memcached_server_count(aConnection) == 0)
+      return;
+
+    memcached_return_t rc;
+    for (std::deque<Op>::const_iterator lIt = aOps.begin(); lIt != aOps.end(); ++lIt)
+    {
+      switch (lIt->theType)
+      {
+        case Op::SET:
+          rc = memcached_set(aConnection, lIt->theKey.c_str(), lIt->theKey.size(),
+              lIt->theValue.data(), lIt->theValue.size(), lIt->theTTL, 0);
+          break;
+        case Op::REMOVE:
+          rc = memcached_delete(aConnection, lIt->theKey.c_str(), lIt->theKey.size(), 0);
+          break;
+        case Op::INCREMENT:
+        {
+          // nothing to do if it doesn't exist, see Memcache::bumpGeneration
+          uint64_t lValue;
+          rc = memcached_increment(aConnection, lIt->theKey.c_str(), lIt->theKey.size(), 1, &lValue);
+          break;
+        }
+      }
+    }
+
+    rc = memcached_flush_buffers(aConnection);
+    if (rc != MEMCACHED_SUCCESS)
+      syslog(LOG_DEBUG, "memcached: sending %u writes failed: %s",
+          (unsigned int)aOps.size(), memcached_strerror(aConnection, rc));
+  }
+
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <time.h>
+#include <deque>
+#include <string>
+#include <boost/unordered_map.hpp>
+
+struct memcached_st;
+
+namespace gridfs {
+
+  /**
+   * background thread which sends all writes to memcached (sets,
+   * deletes, and increments of generations) such that the fuse
+   * threads never wait for memcached when caching or invalidating.
+   *
+   * The writes are sent in order over a single connection with the
+   * binary protocol's noreply flag and buffered such that everything
+   * queued in the meantime goes out together.
+   *
+   * Until an invalidation has been sent, its key is pending and reads
+   * of it have to skip memcached (see Memcache::get), otherwise they
+   * could return what's about to be deleted.
+   *
+   * While the servers are migrating (see MemcacheRing), every write is
+   * sent to the previous ring as well, such that keys copied from there
+   * are never older than the ones written in the meantime.
+   *
+   * If memcached can't keep up, the queue is bounded by dropping sets,
+   * which only costs a later miss. Invalidations are always queued.
+   */
+  class MemcacheQueue
+  {
+    public:
+      MemcacheQueue();
+
+      ~MemcacheQueue();
+
+      void
+      start();
+
+      // sends what's queued and stops
+      void
+      stop();
+
+      void
+      set(const std::string& aKey, const std::string& aValue, time_t aTTL);
+
+      void
+      remove(const std::string& aKey);
+
+      void
+      increment(const std::string& aKey);
+
+      // an invalidation of aKey is queued but hasn't been sent yet
+      bool
+      pending(const std::string& aKey);
+
+    private:
+      struct Op
+      {
+        enum Type { SET, REMOVE, INCREMENT } theType;
+        std::string theKey;
+        std::string theValue;
+        time_t      theTTL;
+      };
+
+      typedef boost::unordered_map<std::string, unsigned int> Pending;
+
+      static void*
+      run(void* aQueue);
+
+      void
+      loop();
+
+      void
+      push(const Op& aOp);
+
+      // sends all operations, the connections might be replaced
+      void
+      send(const std::deque<Op>& aOps);
+
+      static void
+      send(memcached_st* aConnection, const std::deque<Op>& aOps);
+
+      // forbid copying
+      MemcacheQueue(const MemcacheQueue&);
+      MemcacheQueue& operator=(const MemcacheQueue&);
+
+      pthread_t       theThread;
+      bool            theStarted;
+      memcached_st*   theConnection;
+      // to the previous ring while migrating
+      memcached_st*   thePrevious;
+      unsigned int    theVersion;
+
+      // protects the following members
+      pthread_mutex_t theMutex;
+      pthread_cond_t  theCondition;
+      bool            theStopped;
+      std::deque<Op>  theOps;
+      // approximate memory of all queued operations
+      size_t          theQueuedBytes;
+      // sets dropped since the last batch was taken
+      unsigned long   theDropped;
+      // number of queued invalidations per key
+      Pending         thePending;
+  };
+
+}
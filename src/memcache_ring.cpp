@@ -0,0 +1,240 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "memcache_ring.h"
+
+#include <syslog.h>
+#include <sstream>
+#include <libmemcached/memcached.h>
+#include <libmemcached/util/pool.h>
+
+#include "lock.h"
+
+namespace gridfs {
+
+  MemcacheRing::MemcacheRing(unsigned int aWindow)
+    : theWindow(aWindow),
+      theCurrent(build(Servers())),
+      thePrevious(0),
+      theMigrationEnd(0),
+      theVersion(0)
+  {
+    pthread_mutex_init(&theMutex, NULL);
+  }
+
+  MemcacheRing::~MemcacheRing()
+  {
+    theRetired.push_back(theCurrent);
+    if (thePrevious)
+      theRetired.push_back(thePrevious);
+
+    for (std::vector<Ring*>::iterator lIt = theRetired.begin();
+         lIt != theRetired.end();
+         ++lIt)
+      destroy(*lIt);
+    pthread_mutex_destroy(&theMutex);
+  }
+
+  void
+  MemcacheRing::destroy(Ring* aRing)
+  {
+    memcached_pool_destroy(aRing->thePool);
+    memcached_free(aRing->theMaster);
+    delete aRing;
+  }
+
+  void
+  MemcacheRing::collect()
+  {
+    if (thePrevious && time(NULL) >= theMigrationEnd)
+    {
+      theRetired.push_back(thePrevious);
+      thePrevious = 0;
+    }
+
+    std::vector<Ring*>::iterator lIt = theRetired.begin();
+    while (lIt != theRetired.end())
+    {
+      if ((*lIt)->theUsers == 0)
+      {
+        destroy(*lIt);
+        lIt = theRetired.erase(lIt);
+      }
+      else
+        ++lIt;
+    }
+  }
+
+  MemcacheRing::Ring*
+  MemcacheRing::build(const Servers& aServers)
+  {
+    Ring* lRing = new Ring();
+    lRing->theServers = aServers;
+
+    // the same distribution for every connection, including the
+    // ones of the writer thread
+    lRing->theMaster = memcached_create(NULL);
+    memcached_behavior_set(lRing->theMaster, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+    memcached_behavior_set(lRing->theMaster, MEMCACHED_BEHAVIOR_TCP_NODELAY, 1);
+    memcached_behavior_set(lRing->theMaster, MEMCACHED_BEHAVIOR_KETAMA, 1);
+    for (Servers::const_iterator lIt = aServers.begin(); lIt != aServers.end(); ++lIt)
+      memcached_server_add(lRing->theMaster, lIt->first.c_str(), lIt->second);
+
+    lRing->thePool = memcached_pool_create(lRing->theMaster, 100, 200);
+    lRing->theUsers = 0;
+    return lRing;
+  }
+
+  bool
+  MemcacheRing::add(const std::string& aHost, int aPort)
+  {
+    gridfs::Lock lLock(theMutex);
+
+    Servers lServers = theCurrent->theServers;
+    for (Servers::const_iterator lIt = lServers.begin(); lIt != lServers.end(); ++lIt)
+      if (lIt->first == aHost && lIt->second == aPort)
+        return false;
+
+    lServers.push_back(std::make_pair(aHost, aPort));
+    replace(lServers);
+    return true;
+  }
+
+  bool
+  MemcacheRing::remove(const std::string& aHost, int aPort)
+  {
+    gridfs::Lock lLock(theMutex);
+
+    Servers lServers = theCurrent->theServers;
+    for (Servers::iterator lIt = lServers.begin(); lIt != lServers.end(); ++lIt)
+    {
+      if (lIt->first == aHost && lIt->second == aPort)
+      {
+        lServers.erase(lIt);
+        replace(lServers);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void
+  MemcacheRing::replace(const Servers& aServers)
+  {
+    // a previous migration that hasn't finished yet is cut short
+    if (thePrevious)
+      theRetired.push_back(thePrevious);
+
+    // nothing to migrate from an empty ring
+    if (theCurrent->theServers.empty())
+    {
+      theRetired.push_back(theCurrent);
+      thePrevious = 0;
+    }
+    else
+    {
+      thePrevious = theCurrent;
+      theMigrationEnd = time(NULL) + theWindow;
+    }
+
+    theCurrent = build(aServers);
+    ++theVersion;
+    collect();
+
+    syslog(LOG_INFO, "memcached: %u servers, migrating from the previous %u for %u seconds",
+        (unsigned int)aServers.size(),
+        thePrevious ? (unsigned int)thePrevious->theServers.size() : 0,
+        thePrevious ? theWindow : 0);
+  }
+
+  void
+  MemcacheRing::servers(std::vector<std::string>& aServers) const
+  {
+    gridfs::Lock lLock(theMutex);
+
+    for (Servers::const_iterator lIt = theCurrent->theServers.begin();
+         lIt != theCurrent->theServers.end();
+         ++lIt)
+    {
+      std::ostringstream lServer;
+      lServer << lIt->first << ":" << lIt->second;
+      aServers.push_back(lServer.str());
+    }
+  }
+
+  bool
+  MemcacheRing::empty() const
+  {
+    gridfs::Lock lLock(theMutex);
+    return theCurrent->theServers.empty();
+  }
+
+  unsigned int
+  MemcacheRing::version() const
+  {
+    gridfs::Lock lLock(theMutex);
+    return theVersion;
+  }
+
+  MemcacheRing::Ring*
+  MemcacheRing::previous() const
+  {
+    if (!thePrevious || time(NULL) >= theMigrationEnd)
+      return 0;
+    return thePrevious;
+  }
+
+  bool
+  MemcacheRing::migrating() const
+  {
+    gridfs::Lock lLock(theMutex);
+    return previous() != 0;
+  }
+
+  memcached_st*
+  MemcacheRing::clone(bool aPrevious) const
+  {
+    gridfs::Lock lLock(theMutex);
+
+    const Ring* lRing = aPrevious ? previous() : theCurrent;
+    if (!lRing)
+      return 0;
+    return memcached_clone(NULL, lRing->theMaster);
+  }
+
+  MemcacheRing::Connection::Connection(MemcacheRing& aRing, bool aPrevious)
+    : theRing(aRing),
+      theUsed(0),
+      theHandle(0)
+  {
+    {
+      gridfs::Lock lLock(aRing.theMutex);
+
+      Ring* lRing = aPrevious ? aRing.previous() : aRing.theCurrent;
+      if (!lRing || lRing->theServers.empty())
+        return;
+
+      // the ring isn't freed before the connection is returned,
+      // even if it's replaced in the meantime
+      theUsed = lRing;
+      ++theUsed->theUsers;
+    }
+
+    memcached_return rc;
+    theHandle = memcached_pool_pop(theUsed->thePool, true, &rc);
+  }
+
+  MemcacheRing::Connection::~Connection()
+  {
+    if (!theUsed)
+      return;
+
+    if (theHandle)
+      memcached_pool_push(theUsed->thePool, theHandle);
+
+    gridfs::Lock lLock(theRing.theMutex);
+    --theUsed->theUsers;
+    theRing.collect();
+  }
+
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+struct memcached_st;
+struct memcached_pool_st;
+
+namespace gridfs {
+
+  /**
+   * the memcached servers keys are distributed to (consistent hashing
+   * with ketama), changed at runtime through proc/instances.
+   *
+   * Every change builds a new ring with its own master and connection
+   * pool, i.e. all connections taken afterwards see the change. Keys
+   * which are remapped by the change are found on the server that
+   * owned them before for migration_window seconds: reads which miss
+   * ask the previous ring and copy what they find (see
+   * MemcachedCacheBackend), and writes go to both rings (see
+   * MemcacheQueue). Hence, a new server fills up gradually instead of
+   * sending all of its misses to mongo at once. Afterwards, the previous
+   * ring and its pool are freed as soon as none of its connections is
+   * in use anymore.
+   */
+  class MemcacheRing
+  {
+    private:
+      struct Ring;
+
+    public:
+      // aWindow in seconds
+      MemcacheRing(unsigned int aWindow);
+
+      ~MemcacheRing();
+
+      // false if the server is already part of the ring
+      bool
+      add(const std::string& aHost, int aPort);
+
+      // false if the server isn't part of the ring
+      bool
+      remove(const std::string& aHost, int aPort);
+
+      // "host:port" of every server
+      void
+      servers(std::vector<std::string>& aServers) const;
+
+      bool
+      empty() const;
+
+      // changes with every change of the servers
+      unsigned int
+      version() const;
+
+      // keys might still be found in the previous ring only
+      bool
+      migrating() const;
+
+      // a new connection (to be freed by the caller) to the current or,
+      // while migrating, to the previous ring, null otherwise
+      memcached_st*
+      clone(bool aPrevious) const;
+
+      // a pooled connection for the lifetime of the object, null if
+      // the ring has no servers or aPrevious isn't migrating anymore
+      class Connection
+      {
+        public:
+          Connection(MemcacheRing& aRing, bool aPrevious = false);
+
+          ~Connection();
+
+          memcached_st*
+          get() { return theHandle; }
+
+        private:
+          // forbid copying
+          Connection(const Connection&);
+          Connection& operator=(const Connection&);
+
+          MemcacheRing&      theRing;
+          Ring*              theUsed;
+          memcached_st*      theHandle;
+      };
+
+    private:
+      typedef std::vector<std::pair<std::string, int> > Servers;
+
+      struct Ring
+      {
+        Servers            theServers;
+        memcached_st*      theMaster;
+        memcached_pool_st* thePool;
+        // Connections taken from the pool
+        unsigned int       theUsers;
+      };
+
+      static Ring*
+      build(const Servers& aServers);
+
+      static void
+      destroy(Ring* aRing);
+
+      // retires the previous ring once its migration window is over and
+      // frees the retired rings without connections in use, called locked
+      void
+      collect();
+
+      // the previous ring if it's still migrating, called locked
+      Ring*
+      previous() const;
+
+      void
+      replace(const Servers& aServers);
+
+      // forbid copying
+      MemcacheRing(const MemcacheRing&);
+      MemcacheRing& operator=(const MemcacheRing&);
+
+      unsigned int    theWindow;
+
+      // protects the following members
+      mutable pthread_mutex_t theMutex;
+      Ring*           theCurrent;
+      Ring*           thePrevious;
+      time_t          theMigrationEnd;
+      unsigned int    theVersion;
+      // replaced rings whose connections might still be in use
+      std::vector<Ring*> theRetired;
+  };
+
+}
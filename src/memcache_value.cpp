@@ -0,0 +1,192 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "memcache_value.h"
+
+#include <cstring>
+#include "mongo/util/md5.hpp"
+
+#include "metadata.h"
+
+namespace gridfs {
+
+  // changes whenever the encoding changes
+  static const uint8_t VALUE_VERSION = 1;
+
+  std::string
+  memcache_key(char aType, const std::string& aName)
+  {
+    md5_state_t lState;
+    md5_init(&lState);
+    md5_append(&lState, (const md5_byte_t*)aName.data(), (int)aName.size());
+    mongo::md5digest lDigest;
+    md5_finish(&lState, lDigest);
+
+    std::string lKey(1, aType);
+    lKey.append(":").append(mongo::digestToString(lDigest));
+    return lKey;
+  }
+
+  ValueEncoder::ValueEncoder(const std::string& aName)
+  {
+    theValue.reserve(aName.size() + 128);
+    putByte(VALUE_VERSION);
+    putString(aName);
+  }
+
+  ValueEncoder::ValueEncoder()
+  {}
+
+  void
+  ValueEncoder::putByte(uint8_t aValue)
+  {
+    theValue.push_back((char)aValue);
+  }
+
+  void
+  ValueEncoder::putInt(uint32_t aValue)
+  {
+    for (int i = 0; i < 4; ++i)
+      theValue.push_back((char)(aValue >> (8 * i)));
+  }
+
+  void
+  ValueEncoder::putLong(uint64_t aValue)
+  {
+    for (int i = 0; i < 8; ++i)
+      theValue.push_back((char)(aValue >> (8 * i)));
+  }
+
+  void
+  ValueEncoder::putString(const std::string& aValue)
+  {
+    putInt(aValue.size());
+    theValue.append(aValue);
+  }
+
+  void
+  ValueEncoder::putStat(const struct stat* aBuf)
+  {
+    Metadata lMetadata(aBuf);
+    putInt(aBuf->st_mode);
+    putInt(aBuf->st_nlink);
+    putInt(aBuf->st_uid);
+    putInt(aBuf->st_gid);
+    putLong(aBuf->st_size);
+    putLong(aBuf->st_blocks);
+    putLong(Metadata::toNanos(lMetadata.atime));
+    putLong(Metadata::toNanos(lMetadata.mtime));
+    putLong(Metadata::toNanos(lMetadata.ctime));
+  }
+
+  void
+  ValueEncoder::putRaw(const std::string& aValue)
+  {
+    theValue.append(aValue);
+  }
+
+  ValueDecoder::ValueDecoder(const char* aData, size_t aLength, const std::string& aName)
+    : theData(aData),
+      theLength(aLength),
+      thePos(0),
+      theValid(true)
+  {
+    if (getByte() != VALUE_VERSION)
+    {
+      theValid = false;
+      return;
+    }
+
+    // a different name means a collision of the md5 of the keys
+    uint32_t lNameLength = getInt();
+    theValid = theValid
+      && ensure(lNameLength)
+      && aName.compare(0, std::string::npos, theData + thePos, lNameLength) == 0;
+    thePos += theValid ? lNameLength : 0;
+  }
+
+  ValueDecoder::ValueDecoder(const char* aData, size_t aLength)
+    : theData(aData),
+      theLength(aLength),
+      thePos(0),
+      theValid(true)
+  {}
+
+  bool
+  ValueDecoder::ensure(size_t aLength)
+  {
+    if (theValid && theLength - thePos >= aLength)
+      return true;
+    theValid = false;
+    return false;
+  }
+
+  uint8_t
+  ValueDecoder::getByte()
+  {
+    if (!ensure(1))
+      return 0;
+    return (uint8_t)theData[thePos++];
+  }
+
+  uint32_t
+  ValueDecoder::getInt()
+  {
+    if (!ensure(4))
+      return 0;
+    uint32_t lValue = 0;
+    for (int i = 0; i < 4; ++i)
+      lValue |= (uint32_t)(uint8_t)theData[thePos++] << (8 * i);
+    return lValue;
+  }
+
+  uint64_t
+  ValueDecoder::getLong()
+  {
+    if (!ensure(8))
+      return 0;
+    uint64_t lValue = 0;
+    for (int i = 0; i < 8; ++i)
+      lValue |= (uint64_t)(uint8_t)theData[thePos++] << (8 * i);
+    return lValue;
+  }
+
+  std::string
+  ValueDecoder::getString()
+  {
+    uint32_t lLength = getInt();
+    if (!ensure(lLength))
+      return "";
+    std::string lValue(theData + thePos, lLength);
+    thePos += lLength;
+    return lValue;
+  }
+
+  void
+  ValueDecoder::getStat(struct stat* aBuf)
+  {
+    memset(aBuf, 0, sizeof(struct stat));
+
+    Metadata lMetadata(getInt(), 0, 0);
+    aBuf->st_nlink = getInt();
+    lMetadata.uid = getInt();
+    lMetadata.gid = getInt();
+    aBuf->st_size = getLong();
+    aBuf->st_blocks = getLong();
+    lMetadata.atime = Metadata::fromNanos(getLong());
+    lMetadata.mtime = Metadata::fromNanos(getLong());
+    lMetadata.ctime = Metadata::fromNanos(getLong());
+    lMetadata.toStat(aBuf);
+  }
+
+  std::string
+  ValueDecoder::getRaw()
+  {
+    if (!theValid)
+      return "";
+    std::string lValue(theData + thePos, theLength - thePos);
+    thePos = theLength;
+    return lValue;
+  }
+
+}
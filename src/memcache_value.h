@@ -0,0 +1,111 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <string>
+
+namespace gridfs {
+
+  // the memcached key of aName (a path, or a directory for listings)
+  // as "<aType>:<md5 of aName>", i.e. it has the same length for every
+  // path and never exceeds memcached's limit of 250 bytes
+  std::string
+  memcache_key(char aType, const std::string& aName);
+
+  /**
+   * writes a value stored in memcached.
+   *
+   * Every value starts with the version of the encoding and with the
+   * name it belongs to such that readers can tell values of another
+   * version or of a colliding key apart. Numbers are stored in little
+   * endian, and a stat struct only with the fields the filesystem sets
+   * (56 bytes instead of the 144 of the native struct), i.e. mounts on
+   * different platforms can share the same memcached servers.
+   */
+  class ValueEncoder
+  {
+    public:
+      ValueEncoder(const std::string& aName);
+
+      // without version and name, e.g. for a part of a value
+      ValueEncoder();
+
+      void
+      putByte(uint8_t aValue);
+
+      void
+      putInt(uint32_t aValue);
+
+      void
+      putLong(uint64_t aValue);
+
+      // length and content
+      void
+      putString(const std::string& aValue);
+
+      void
+      putStat(const struct stat* aBuf);
+
+      // content only, e.g. everything until the end of the value
+      void
+      putRaw(const std::string& aValue);
+
+      const std::string&
+      value() const { return theValue; }
+
+    private:
+      std::string theValue;
+  };
+
+  /**
+   * reads a value written by ValueEncoder. Reading past the end or a
+   * value of another version or name makes the decoder invalid.
+   */
+  class ValueDecoder
+  {
+    public:
+      ValueDecoder(const char* aData, size_t aLength, const std::string& aName);
+
+      // without version and name, e.g. for a part of a value
+      ValueDecoder(const char* aData, size_t aLength);
+
+      bool
+      valid() const { return theValid; }
+
+      bool
+      atEnd() const { return thePos == theLength; }
+
+      uint8_t
+      getByte();
+
+      uint32_t
+      getInt();
+
+      uint64_t
+      getLong();
+
+      std::string
+      getString();
+
+      void
+      getStat(struct stat* aBuf);
+
+      // everything that's left
+      std::string
+      getRaw();
+
+    private:
+      // false and invalid if fewer than aLength bytes are left
+      bool
+      ensure(size_t aLength);
+
+      const char* theData;
+      size_t      theLength;
+      size_t      thePos;
+      bool        theValid;
+  };
+
+}
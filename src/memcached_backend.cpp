@@ -0,0 +1,177 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "memcached_backend.h"
+
+#include <cstdlib>
+#include <libmemcached/memcached.h>
+
+#include "gridfs_fuse.h"
+#include "memcache_ring.h"
+
+namespace gridfs {
+
+  MemcachedCacheBackend::MemcachedCacheBackend()
+  {}
+
+  // a single value, false if it's missing
+  static bool
+  fetch(memcached_st* aConnection, const std::string& aKey, std::string& aValue)
+  {
+    uint32_t lFlags = 0;
+    size_t lLength  = 0;
+    memcached_return_t rc;
+
+    char* lResult = memcached_get(aConnection, aKey.c_str(), aKey.size(), &lLength, &lFlags, &rc);
+    if (!lResult)
+      return false;
+
+    aValue.assign(lResult, lLength);
+    free(lResult);
+    return true;
+  }
+
+  // the values of all keys at once (a single round-trip per server),
+  // only the missing ones (i.e. empty) are fetched
+  static void
+  fetch(memcached_st* aConnection, const std::vector<std::string>& aKeys, std::vector<std::string>& aValues)
+  {
+    boost::unordered_map<std::string, size_t> lPositions;
+    std::vector<const char*> lKeyPtrs;
+    std::vector<size_t> lKeyLengths;
+    for (size_t i = 0; i < aKeys.size(); ++i)
+    {
+      if (!aValues[i].empty())
+        continue;
+      lPositions[aKeys[i]] = i;
+      lKeyPtrs.push_back(aKeys[i].c_str());
+      lKeyLengths.push_back(aKeys[i].size());
+    }
+    if (lKeyPtrs.empty())
+      return;
+
+    memcached_return_t rc = memcached_mget(aConnection, &lKeyPtrs[0], &lKeyLengths[0], lKeyPtrs.size());
+
+    char lKey[MEMCACHED_MAX_KEY];
+    size_t lKeyLength, lLength;
+    uint32_t lFlags;
+    char* lResult;
+    while (rc == MEMCACHED_SUCCESS &&
+        (lResult = memcached_fetch(aConnection, lKey, &lKeyLength, &lLength, &lFlags, &rc)))
+    {
+      boost::unordered_map<std::string, size_t>::const_iterator lIt =
+        lPositions.find(std::string(lKey, lKeyLength));
+      if (lIt != lPositions.end())
+        aValues[lIt->second].assign(lResult, lLength);
+      free(lResult);
+    }
+  }
+
+  // seconds a value copied from the previous ring lives in the new one
+  static const unsigned int MIGRATED_TTL = 10;
+
+  void
+  MemcachedCacheBackend::migrate(memcached_st* aConnection, const std::string& aKey, const std::string& aValue)
+  {
+    // removed since it has been read, the add would resurrect it
+    if (pending(aKey))
+      return;
+
+    // a remove that has been sent since (e.g. by another mount) isn't
+    // pending anymore, i.e. the copy might be stale and is only kept
+    // until the next read goes to mongo
+    unsigned int lTTL = MIGRATED_TTL;
+    if (FUSE.config.memcached_ttl != 0 && FUSE.config.memcached_ttl < lTTL)
+      lTTL = FUSE.config.memcached_ttl;
+
+    // unless it has been written in the meantime
+    memcached_add(aConnection, aKey.c_str(), aKey.size(),
+        aValue.data(), aValue.size(), lTTL, 0);
+  }
+
+  bool
+  MemcachedCacheBackend::get(const std::string& aKey, std::string& aValue)
+  {
+    MemcacheRing::Connection lConnection(*FUSE.ring());
+    if (!lConnection.get())
+      return false;
+
+    if (fetch(lConnection.get(), aKey, aValue))
+      return true;
+
+    MemcacheRing::Connection lPrevious(*FUSE.ring(), true);
+    if (!lPrevious.get() || !fetch(lPrevious.get(), aKey, aValue))
+      return false;
+
+    migrate(lConnection.get(), aKey, aValue);
+    return true;
+  }
+
+  void
+  MemcachedCacheBackend::get(const std::vector<std::string>& aKeys, std::vector<std::string>& aValues)
+  {
+    aValues.clear();
+    aValues.resize(aKeys.size());
+    if (aKeys.empty())
+      return;
+
+    MemcacheRing::Connection lConnection(*FUSE.ring());
+    if (!lConnection.get())
+      return;
+
+    fetch(lConnection.get(), aKeys, aValues);
+
+    size_t lMissing = 0;
+    for (size_t i = 0; i < aValues.size(); ++i)
+      if (aValues[i].empty())
+        ++lMissing;
+    if (lMissing == 0)
+      return;
+
+    MemcacheRing::Connection lPrevious(*FUSE.ring(), true);
+    if (!lPrevious.get())
+      return;
+
+    std::vector<std::string> lValues(aValues);
+    fetch(lPrevious.get(), aKeys, lValues);
+    for (size_t i = 0; i < aValues.size(); ++i)
+    {
+      if (aValues[i].empty() && !lValues[i].empty())
+      {
+        migrate(lConnection.get(), aKeys[i], lValues[i]);
+        aValues[i].swap(lValues[i]);
+      }
+    }
+  }
+
+  void
+  MemcachedCacheBackend::set(const std::string& aKey, const std::string& aValue, time_t aTTL)
+  {
+    theQueue.set(aKey, aValue, aTTL);
+  }
+
+  void
+  MemcachedCacheBackend::add(const std::string& aKey, const std::string& aValue, time_t aTTL)
+  {
+    // not queued, the caller reads the key right afterwards
+    MemcacheRing::Connection lConnection(*FUSE.ring());
+    if (!lConnection.get())
+      return;
+
+    memcached_add(lConnection.get(), aKey.c_str(), aKey.size(),
+        aValue.data(), aValue.size(), aTTL, 0);
+  }
+
+  void
+  MemcachedCacheBackend::remove(const std::string& aKey)
+  {
+    theQueue.remove(aKey);
+  }
+
+  void
+  MemcachedCacheBackend::increment(const std::string& aKey)
+  {
+    theQueue.increment(aKey);
+  }
+
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include "cache_backend.h"
+#include "memcache_queue.h"
+
+struct memcached_st;
+
+namespace gridfs {
+
+  /**
+   * memcached servers shared by all mounts. Reads take a connection
+   * from the pool of the current ring, writes are queued (see
+   * MemcacheQueue). Without any servers (e.g. before one is added
+   * through proc/instances) every read is a miss without taking a
+   * connection. Reads which miss while the ring is migrating ask the
+   * previous ring (see MemcacheRing).
+   */
+  class MemcachedCacheBackend : public CacheBackend
+  {
+    public:
+      MemcachedCacheBackend();
+
+      virtual void
+      start() { theQueue.start(); }
+
+      virtual void
+      stop() { theQueue.stop(); }
+
+      virtual bool
+      get(const std::string& aKey, std::string& aValue);
+
+      virtual void
+      get(const std::vector<std::string>& aKeys, std::vector<std::string>& aValues);
+
+      virtual void
+      set(const std::string& aKey, const std::string& aValue, time_t aTTL);
+
+      virtual void
+      add(const std::string& aKey, const std::string& aValue, time_t aTTL);
+
+      virtual void
+      remove(const std::string& aKey);
+
+      virtual void
+      increment(const std::string& aKey);
+
+      virtual bool
+      pending(const std::string& aKey) { return theQueue.pending(aKey); }
+
+    private:
+      // copies a value found in the previous ring while migrating
+      void
+      migrate(memcached_st* aConnection, const std::string& aKey, const std::string& aValue);
+
+      MemcacheQueue theQueue;
+  };
+
+}
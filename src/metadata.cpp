@@ -0,0 +1,176 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "metadata.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <sys/time.h>
+
+namespace gridfs {
+
+  Metadata::Metadata(mode_t aMode, uid_t aUid, gid_t aGid)
+    : mode(aMode),
+      uid(aUid),
+      gid(aGid)
+  {
+    atime = mtime = ctime = now();
+  }
+
+  Metadata::Metadata(const struct stat* aBuf)
+    : mode(aBuf->st_mode),
+      uid(aBuf->st_uid),
+      gid(aBuf->st_gid)
+  {
+#   ifdef __APPLE__
+    atime = aBuf->st_atimespec;
+    mtime = aBuf->st_mtimespec;
+    ctime = aBuf->st_ctimespec;
+#   else
+    atime = aBuf->st_atim;
+    mtime = aBuf->st_mtim;
+    ctime = aBuf->st_ctim;
+#   endif
+  }
+
+  Metadata::Metadata(const mongo::BSONObj& aFile, uid_t aDefaultUid, gid_t aDefaultGid)
+    : mode(S_IFREG | 0644), // defaults to a file because that is only supported natively in mongo gridfs
+      uid(aDefaultUid),
+      gid(aDefaultGid)
+  {
+    atime = mtime = ctime = fromNanos(0);
+
+    if (!isStructured(aFile))
+    {
+      parseContentType(aFile.getStringField("contentType"));
+      return;
+    }
+
+    mongo::BSONObj lMetadata = aFile["metadata"].Obj();
+    mongo::BSONElement lField;
+
+    if ((lField = lMetadata["mode"]).isNumber())
+      mode = lField.numberInt();
+    if ((lField = lMetadata["uid"]).isNumber())
+      uid = lField.numberInt();
+    if ((lField = lMetadata["gid"]).isNumber())
+      gid = lField.numberInt();
+    if ((lField = lMetadata["mtime"]).isNumber())
+      mtime = fromNanos(lField.numberLong());
+
+    // entries which have never been accessed or changed
+    // since their last modification
+    atime = ctime = mtime;
+    if ((lField = lMetadata["atime"]).isNumber())
+      atime = fromNanos(lField.numberLong());
+    if ((lField = lMetadata["ctime"]).isNumber())
+      ctime = fromNanos(lField.numberLong());
+  }
+
+  bool
+  Metadata::isStructured(const mongo::BSONObj& aFile)
+  {
+    mongo::BSONElement lMetadata = aFile["metadata"];
+    return lMetadata.type() == mongo::Object
+      && lMetadata.Obj()["mode"].isNumber();
+  }
+
+  mongo::BSONObj
+  Metadata::toBSON(const mongo::BSONObj& aOther) const
+  {
+    mongo::BSONObjBuilder lBuilder;
+    lBuilder.append("mode", (int)mode);
+    lBuilder.append("uid", (int)uid);
+    lBuilder.append("gid", (int)gid);
+    lBuilder.append("atime", toNanos(atime));
+    lBuilder.append("mtime", toNanos(mtime));
+    lBuilder.append("ctime", toNanos(ctime));
+
+    mongo::BSONObjIterator lIt(aOther);
+    while (lIt.more())
+    {
+      mongo::BSONElement lField = lIt.next();
+      const char* lName = lField.fieldName();
+      if (strcmp(lName, "mode") && strcmp(lName, "uid") && strcmp(lName, "gid") &&
+          strcmp(lName, "atime") && strcmp(lName, "mtime") && strcmp(lName, "ctime"))
+        lBuilder.append(lField);
+    }
+
+    return lBuilder.obj();
+  }
+
+  void
+  Metadata::toStat(struct stat* aBuf) const
+  {
+    aBuf->st_mode = mode;
+    aBuf->st_uid = uid;
+    aBuf->st_gid = gid;
+#   ifdef __APPLE__
+    aBuf->st_atimespec = atime;
+    aBuf->st_mtimespec = mtime;
+    aBuf->st_ctimespec = ctime;
+#   else
+    aBuf->st_atim = atime;
+    aBuf->st_mtim = mtime;
+    aBuf->st_ctim = ctime;
+#   endif
+  }
+
+  long long
+  Metadata::toNanos(const struct timespec& aTime)
+  {
+    return (long long)aTime.tv_sec * 1000000000LL + aTime.tv_nsec;
+  }
+
+  struct timespec
+  Metadata::fromNanos(long long aNanos)
+  {
+    struct timespec lTime;
+    lTime.tv_sec = aNanos / 1000000000LL;
+    lTime.tv_nsec = aNanos % 1000000000LL;
+    return lTime;
+  }
+
+  struct timespec
+  Metadata::now()
+  {
+    struct timeval lNow;
+    gettimeofday(&lNow, NULL);
+
+    struct timespec lTime;
+    lTime.tv_sec = lNow.tv_sec;
+    lTime.tv_nsec = lNow.tv_usec * 1000;
+    return lTime;
+  }
+
+  void
+  Metadata::parseContentType(const std::string& aContentType)
+  {
+    // we expect e.g. "m:16877|u:0|g:0|t:1321927291"
+    const char* lPos = aContentType.c_str();
+    while (*lPos != '\0')
+    {
+      char lType = lPos[0];
+      if (lPos[1] != ':')
+        break;
+
+      char* lEnd;
+      long long lValue = strtoll(lPos + 2, &lEnd, 10);
+      switch (lType)
+      {
+        case 'm': mode = lValue; break;
+        case 'u': uid = lValue; break;
+        case 'g': gid = lValue; break;
+        case 't': mtime.tv_sec = lValue; break;
+      }
+
+      lPos = lEnd;
+      if (*lPos == '|')
+        ++lPos;
+    }
+
+    // the legacy format only knows a single time
+    atime = ctime = mtime;
+  }
+
+}
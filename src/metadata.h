@@ -0,0 +1,74 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <mongo/client/redef_macros.h> //To fix ill-defined macros
+#include <mongo/client/dbclient.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+namespace gridfs {
+
+  /**
+   * the attributes of a filesystem entry which are stored in the
+   * "metadata" subdocument of its files document, e.g.
+   *
+   *   metadata: { mode: 33188, uid: 1000, gid: 1000,
+   *               atime: NumberLong(...), mtime: NumberLong(...),
+   *               ctime: NumberLong(...) }
+   *
+   * with the times in nanoseconds since the epoch.
+   *
+   * Older versions of the filesystem packed mode, uid, gid and mtime into
+   * the contentType field (e.g. "m:16877|u:0|g:0|t:1321927291"). This
+   * legacy format is still read for files that haven't been migrated
+   * (see gridfs-migrate).
+   */
+  struct Metadata
+  {
+    // all times set to now
+    Metadata(mode_t aMode, uid_t aUid, gid_t aGid);
+
+    // from a files document, falling back to the legacy format and
+    // to the given defaults for everything that's not there
+    Metadata(const mongo::BSONObj& aFile, uid_t aDefaultUid, gid_t aDefaultGid);
+
+    // the attributes of a stat struct, i.e. the reverse of toStat
+    explicit Metadata(const struct stat* aBuf);
+
+    // whether the files document has the structured metadata
+    static bool
+    isStructured(const mongo::BSONObj& aFile);
+
+    // the metadata subdocument. Fields of aOther (e.g. user metadata of
+    // a previous version) that aren't attributes are kept.
+    mongo::BSONObj
+    toBSON(const mongo::BSONObj& aOther = mongo::BSONObj()) const;
+
+    void
+    toStat(struct stat* aBuf) const;
+
+    static long long
+    toNanos(const struct timespec& aTime);
+
+    static struct timespec
+    fromNanos(long long aNanos);
+
+    static struct timespec
+    now();
+
+    mode_t mode;
+    uid_t  uid;
+    gid_t  gid;
+    struct timespec atime;
+    struct timespec mtime;
+    struct timespec ctime;
+
+  private:
+    void
+    parseContentType(const std::string& aContentType);
+  };
+
+}
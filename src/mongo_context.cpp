@@ -0,0 +1,116 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "mongo_context.h"
+
+#include <pthread.h>
+#include <syslog.h>
+#include <mongo/client/connpool.h>
+
+#include "gridfs_fuse.h"
+
+namespace gridfs {
+
+  static pthread_key_t  theContextKey;
+  static pthread_once_t theContextKeyOnce = PTHREAD_ONCE_INIT;
+
+  void
+  MongoContext::createKey()
+  {
+    pthread_key_create(&theContextKey, destroy);
+  }
+
+  void
+  MongoContext::destroy(void* aContext)
+  {
+    delete static_cast<MongoContext*>(aContext);
+  }
+
+  MongoContext&
+  MongoContext::get()
+  {
+    pthread_once(&theContextKeyOnce, createKey);
+
+    MongoContext* lContext = static_cast<MongoContext*>(pthread_getspecific(theContextKey));
+    if (!lContext)
+    {
+      lContext = new MongoContext();
+      pthread_setspecific(theContextKey, lContext);
+    }
+
+    lContext->connect();
+    return *lContext;
+  }
+
+  const std::string&
+  MongoContext::filesCollection()
+  {
+    static const std::string lFiles = std::string(FUSE.config.mongo_db) + "." +
+      FUSE.config.mongo_collection_prefix + ".files";
+    return lFiles;
+  }
+
+  const std::string&
+  MongoContext::chunksCollection()
+  {
+    static const std::string lChunks = std::string(FUSE.config.mongo_db) + "." +
+      FUSE.config.mongo_collection_prefix + ".chunks";
+    return lChunks;
+  }
+
+  MongoContext::MongoContext()
+    : theConnection(0),
+      theGridFS(0)
+  {}
+
+  MongoContext::~MongoContext()
+  {
+    disconnect();
+  }
+
+  void
+  MongoContext::connect()
+  {
+    if (theConnection && theGridFS && !theConnection->isFailed())
+      return;
+
+    if (theConnection)
+      syslog(LOG_INFO, "mongo: reconnecting after a failure");
+    disconnect();
+
+    // the pool takes care of authentication (see AuthHook)
+    theConnection = mongo::pool.get(FUSE.connection_string());
+    theGridFS = new mongo::GridFS(
+        *theConnection,
+        FUSE.config.mongo_db,
+        FUSE.config.mongo_collection_prefix);
+
+    // lookups of the latest version by filename, covers exists()
+    theConnection->ensureIndex(
+        filesCollection(),
+        BSON("filename" << 1 << "uploadDate" << -1));
+
+    // directory listings in filename order, latest version first
+    theConnection->ensureIndex(
+        filesCollection(),
+        BSON("parent" << 1 << "filename" << 1 << "uploadDate" << -1));
+  }
+
+  void
+  MongoContext::disconnect()
+  {
+    delete theGridFS;
+    theGridFS = 0;
+
+    if (!theConnection)
+      return;
+
+    // a failed connection can't be reused by anyone
+    if (theConnection->isFailed())
+      delete theConnection;
+    else
+      mongo::pool.release(FUSE.connection_string().toString(), theConnection);
+    theConnection = 0;
+  }
+
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <string>
+
+#include <mongo/client/redef_macros.h> //To fix ill-defined macros
+#include <mongo/client/dbclient.h>
+#include <mongo/client/gridfs.h>
+
+namespace gridfs {
+
+  /**
+   * the mongo connection of a fuse thread together with what every
+   * filesystem operation needs besides it, i.e. the GridFS handle and
+   * the names of the collections.
+   *
+   * Each thread takes a connection from the pool the first time it
+   * needs one and keeps it until it exits. It's only used by the
+   * thread itself, i.e. objects living longer than an operation (e.g.
+   * the FileInfo of an open file) ask for it again every time because
+   * the next operation might run on another thread. Hence, an operation neither
+   * contends for the lock of the pool nor repeats the index checks of
+   * the GridFS constructor. A connection that failed (e.g. because the
+   * primary stepped down) is dropped and replaced by a new one the next
+   * time the thread asks for it.
+   */
+  class MongoContext
+  {
+    public:
+      // the context of the calling thread
+      static MongoContext&
+      get();
+
+      mongo::DBClientBase&
+      connection() { return *theConnection; }
+
+      mongo::GridFS&
+      gridfs() { return *theGridFS; }
+
+      static const std::string&
+      filesCollection();
+
+      static const std::string&
+      chunksCollection();
+
+    private:
+      MongoContext();
+
+      ~MongoContext();
+
+      // a new connection if there is none or it failed
+      void
+      connect();
+
+      void
+      disconnect();
+
+      static void
+      destroy(void* aContext);
+
+      static void
+      createKey();
+
+      // forbid copying
+      MongoContext(const MongoContext&);
+      MongoContext& operator=(const MongoContext&);
+
+      mongo::DBClientBase* theConnection;
+      mongo::GridFS*       theGridFS;
+  };
+
+}
@@ -0,0 +1,683 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "namespace_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <syslog.h>
+#include <mongo/client/connpool.h>
+
+#include "filesystem_entry.h"
+#include "metadata.h"
+#include "lock.h"
+
+namespace gridfs {
+
+  // orders the children of a node by name
+  struct NodeName
+  {
+    template <class Node>
+    bool
+    operator()(const Node* aNode, const std::string& aName) const
+    {
+      return aNode->theName < aName;
+    }
+  };
+
+  static std::string
+  files_collection()
+  {
+    return std::string(FUSE.config.mongo_db) + "." +
+      FUSE.config.mongo_collection_prefix + ".files";
+  }
+
+  template <class Record>
+  static bool
+  by_path(
+      const std::pair<std::string, Record>& aFirst,
+      const std::pair<std::string, Record>& aSecond)
+  {
+    return aFirst.first < aSecond.first;
+  }
+
+  // whether aPath is the root of the mount or below it
+  static bool
+  is_mounted(const std::string& aPath)
+  {
+    static const std::string lPrefix = FUSE.config.path_prefix;
+    return aPath.compare(0, lPrefix.size(), lPrefix) == 0 &&
+      (aPath.size() == lPrefix.size() || aPath[lPrefix.size()] == '/');
+  }
+
+  NamespaceIndex::Record::Record()
+    : theAtime(0),
+      theMtime(0),
+      theCtime(0),
+      theSize(0),
+      theBlocks(0),
+      theUploadDate(0),
+      theMode(0),
+      theUid(0),
+      theGid(0)
+  {
+  }
+
+  NamespaceIndex::Record::Record(const mongo::BSONObj& aFile)
+  {
+    Metadata lMetadata(aFile, FUSE.config.default_uid, FUSE.config.default_gid);
+    theMode = lMetadata.mode;
+    theUid = lMetadata.uid;
+    theGid = lMetadata.gid;
+    theAtime = Metadata::toNanos(lMetadata.atime);
+    theMtime = Metadata::toNanos(lMetadata.mtime);
+    theCtime = Metadata::toNanos(lMetadata.ctime);
+
+    struct stat lStat;
+    FilesystemEntry::stat(aFile, &lStat);
+    theSize = lStat.st_size;
+    theBlocks = lStat.st_blocks;
+
+    theUploadDate = aFile["uploadDate"].date().millis;
+
+    mongo::BSONElement lId = aFile["_id"];
+    if (lId.type() == mongo::jstOID)
+      theId = lId.OID();
+  }
+
+  void
+  NamespaceIndex::Record::toStat(struct stat* aBuf) const
+  {
+    memset(aBuf, 0, sizeof(struct stat));
+
+    Metadata lMetadata(theMode, theUid, theGid);
+    lMetadata.atime = Metadata::fromNanos(theAtime);
+    lMetadata.mtime = Metadata::fromNanos(theMtime);
+    lMetadata.ctime = Metadata::fromNanos(theCtime);
+    lMetadata.toStat(aBuf);
+
+    // same as FilesystemEntry::stat
+    aBuf->st_nlink = (theMode & S_IFDIR) ? 2 : 1;
+    aBuf->st_size = theSize;
+    aBuf->st_blocks = theBlocks;
+  }
+
+  NamespaceIndex::Node::~Node()
+  {
+    for (size_t i = 0; i < theChildren.size(); ++i)
+      delete theChildren[i];
+  }
+
+  NamespaceIndex::NamespaceIndex(unsigned int aThreads)
+    : theThreads(aThreads == 0 ? 1 : aThreads),
+      theRoot(new Node("", 0)),
+      theReady(false),
+      theLoading(false),
+      theJoinable(false),
+      theScanFailed(false),
+      theStale(false),
+      theStopped(false)
+  {
+    pthread_rwlock_init(&theLock, NULL);
+    pthread_mutex_init(&theLoadMutex, NULL);
+  }
+
+  NamespaceIndex::~NamespaceIndex()
+  {
+    theStopped = true;
+    if (theJoinable)
+      pthread_join(theLoader, NULL);
+
+    pthread_mutex_destroy(&theLoadMutex);
+    pthread_rwlock_destroy(&theLock);
+    delete theRoot;
+  }
+
+  void
+  NamespaceIndex::reload()
+  {
+    gridfs::Lock lLock(theLoadMutex);
+    if (theLoading || theStopped)
+      return;
+
+    // the previous load is done, it doesn't lock anymore
+    if (theJoinable)
+    {
+      pthread_join(theLoader, NULL);
+      theJoinable = false;
+    }
+
+    theLoading = true;
+    theDirty.clear();
+    if (pthread_create(&theLoader, NULL, runLoad, this) != 0)
+    {
+      syslog(LOG_ERR, "namespace index: couldn't start loading");
+      theLoading = false;
+      return;
+    }
+    theJoinable = true;
+  }
+
+  void*
+  NamespaceIndex::runLoad(void* aIndex)
+  {
+    static_cast<NamespaceIndex*>(aIndex)->load();
+    return NULL;
+  }
+
+  void*
+  NamespaceIndex::runScan(void* aScan)
+  {
+    Scan* lScan = static_cast<Scan*>(aScan);
+    lScan->theIndex->scan(lScan->theQuery);
+    return NULL;
+  }
+
+  void
+  NamespaceIndex::load()
+  {
+    syslog(LOG_INFO, "namespace index: loading");
+
+    bool lFailed;
+    bool lStale;
+    Records lLoaded;
+    do
+    {
+      lFailed = theStopped;
+      try
+      {
+        std::vector<mongo::BSONObj> lQueries;
+        {
+          mongo::ScopedDbConnection lConnection(FUSE.connection_string());
+          lQueries = partition(*lConnection.get());
+          lConnection.done();
+        }
+
+        std::vector<Scan> lScans(lQueries.size());
+        for (size_t i = 0; i < lScans.size(); ++i)
+        {
+          lScans[i].theIndex = this;
+          lScans[i].theQuery = lQueries[i];
+          pthread_create(&lScans[i].theThread, NULL, runScan, &lScans[i]);
+        }
+        for (size_t i = 0; i < lScans.size(); ++i)
+          pthread_join(lScans[i].theThread, NULL);
+      }
+      catch (std::exception& e)
+      {
+        syslog(LOG_ERR, "namespace index: %s", e.what());
+        lFailed = true;
+      }
+
+      gridfs::Lock lLock(theLoadMutex);
+      Records().swap(lLoaded);
+      lLoaded.swap(theLoaded);
+      lFailed = lFailed || theStopped || theScanFailed;
+      lStale = theStale;
+      theScanFailed = false;
+      theStale = false;
+    }
+    while (lStale && !lFailed);
+
+    if (!lFailed)
+    {
+      // in path order, the children of every node are appended
+      // in order, i.e. building the tree doesn't move any of them
+      std::sort(lLoaded.begin(), lLoaded.end(), by_path<Record>);
+
+      Node* lRoot = new Node("", 0);
+      Ids lIds;
+      for (Records::const_iterator lIt = lLoaded.begin(); lIt != lLoaded.end(); ++lIt)
+        set(lRoot, lIds, lIt->first, lIt->second, false);
+      Records().swap(lLoaded);
+
+      {
+        pthread_rwlock_wrlock(&theLock);
+        std::swap(theRoot, lRoot);
+        theIds.swap(lIds);
+        theReady = true;
+        pthread_rwlock_unlock(&theLock);
+      }
+      delete lRoot;
+    }
+
+    std::set<std::string> lDirty;
+    {
+      gridfs::Lock lLock(theLoadMutex);
+      lDirty.swap(theDirty);
+      theLoading = false;
+    }
+
+    if (lFailed)
+    {
+      syslog(LOG_ERR, "namespace index: loading failed");
+      return;
+    }
+
+    // changed while loading, the scan might have read an older version
+    for (std::set<std::string>::const_iterator lIt = lDirty.begin();
+         lIt != lDirty.end() && !theStopped;
+         ++lIt)
+    {
+      try
+      {
+        refresh(*lIt);
+      }
+      catch (std::exception& e)
+      {
+        syslog(LOG_ERR, "namespace index: refreshing %s: %s", lIt->c_str(), e.what());
+      }
+    }
+
+    syslog(LOG_INFO, "namespace index: loaded");
+  }
+
+  std::vector<mongo::BSONObj>
+  NamespaceIndex::partition(mongo::DBClientBase& aConnection)
+  {
+    std::vector<mongo::BSONObj> lQueries;
+
+    static const mongo::BSONObj lFields = BSON("_id" << 1);
+    mongo::BSONObj lIsOID = BSON("_id" << BSON("$type" << mongo::jstOID));
+
+    mongo::BSONObj lFirst = aConnection.findOne(
+        files_collection(), mongo::Query(lIsOID).sort("_id", 1), &lFields);
+    mongo::BSONObj lLast = aConnection.findOne(
+        files_collection(), mongo::Query(lIsOID).sort("_id", -1), &lFields);
+
+    // ObjectIds start with their creation time, so split the time
+    // between the first and the last one into equal ranges
+    if (!lFirst.isEmpty() && !lLast.isEmpty())
+    {
+      unsigned long long lFrom = lFirst["_id"].OID().asTimeT();
+      unsigned long long lTo = lLast["_id"].OID().asTimeT() + 1;
+      unsigned long long lStep = std::max(1ULL, (lTo - lFrom + theThreads - 1) / theThreads);
+
+      for (unsigned long long lTime = lFrom; lTime < lTo; lTime += lStep)
+      {
+        mongo::OID lLow;
+        lLow.init(mongo::Date_t(lTime * 1000));
+        mongo::OID lHigh;
+        lHigh.init(mongo::Date_t(std::min(lTime + lStep, lTo) * 1000));
+
+        lQueries.push_back(BSON("_id" << BSON("$gte" << lLow << "$lt" << lHigh)));
+      }
+    }
+
+    // documents with other ids, e.g. written by other gridfs clients
+    lQueries.push_back(BSON("_id" << BSON("$not" << BSON("$type" << mongo::jstOID))));
+    return lQueries;
+  }
+
+  void
+  NamespaceIndex::scan(const mongo::BSONObj& aQuery)
+  {
+    Records lRecords;
+    try
+    {
+      mongo::ScopedDbConnection lConnection(FUSE.connection_string());
+      std::auto_ptr<mongo::DBClientCursor> lCursor = lConnection->query(
+          files_collection(),
+          aQuery,
+          0, 0,
+          &FilesystemEntry::statFields(),
+          mongo::QueryOption_NoCursorTimeout,
+          FUSE.config.readdir_batch_size);
+
+      while (!theStopped && lCursor->more())
+      {
+        mongo::BSONObj lFile = lCursor->next();
+        std::string lPath = lFile.getStringField("filename");
+        if (is_mounted(lPath))
+          lRecords.push_back(std::make_pair(lPath, Record(lFile)));
+      }
+
+      lCursor.reset();
+      lConnection.done();
+    }
+    catch (std::exception& e)
+    {
+      syslog(LOG_ERR, "namespace index: scan failed: %s", e.what());
+      gridfs::Lock lLock(theLoadMutex);
+      theScanFailed = true;
+      return;
+    }
+
+    gridfs::Lock lLock(theLoadMutex);
+    theLoaded.insert(theLoaded.end(), lRecords.begin(), lRecords.end());
+  }
+
+  Memcache::Result
+  NamespaceIndex::get(const std::string& aPath, struct stat* aBuf)
+  {
+    if (!theReady)
+      return Memcache::UNKNOWN;
+
+    pthread_rwlock_rdlock(&theLock);
+    Node* lNode = find(theRoot, aPath);
+    Memcache::Result lResult = Memcache::MISSING;
+    if (lNode && lNode->theExists)
+    {
+      lNode->theRecord.toStat(aBuf);
+      lResult = Memcache::EXISTS;
+    }
+    pthread_rwlock_unlock(&theLock);
+    return lResult;
+  }
+
+  Memcache::Listing
+  NamespaceIndex::list(const std::string& aDir)
+  {
+    if (!theReady)
+      return Memcache::Listing();
+
+    Memcache::Attributes* lEntries = 0;
+
+    pthread_rwlock_rdlock(&theLock);
+    Node* lNode = find(theRoot, aDir);
+    if (lNode && lNode->theExists)
+    {
+      lEntries = new Memcache::Attributes();
+      lEntries->reserve(lNode->theChildren.size());
+      for (size_t i = 0; i < lNode->theChildren.size(); ++i)
+      {
+        const Node* lChild = lNode->theChildren[i];
+        if (!lChild->theExists)
+          continue;
+
+        struct stat lStat;
+        lChild->theRecord.toStat(&lStat);
+        lEntries->push_back(std::make_pair(lChild->theName, lStat));
+      }
+    }
+    pthread_rwlock_unlock(&theLock);
+
+    return Memcache::Listing(lEntries);
+  }
+
+  bool
+  NamespaceIndex::isEmpty(const std::string& aDir, bool& aEmpty)
+  {
+    if (!theReady)
+      return false;
+
+    bool lKnown = false;
+
+    pthread_rwlock_rdlock(&theLock);
+    Node* lNode = find(theRoot, aDir);
+    if (lNode && lNode->theExists)
+    {
+      lKnown = true;
+      aEmpty = true;
+      for (size_t i = 0; i < lNode->theChildren.size() && aEmpty; ++i)
+        aEmpty = !lNode->theChildren[i]->theExists;
+    }
+    pthread_rwlock_unlock(&theLock);
+
+    return lKnown;
+  }
+
+  void
+  NamespaceIndex::refresh(const std::string& aPath)
+  {
+    {
+      gridfs::Lock lLock(theLoadMutex);
+      if (theLoading)
+        theDirty.insert(aPath);
+    }
+
+    if (!theReady || !is_mounted(aPath))
+      return;
+
+    mongo::ScopedDbConnection lConnection(FUSE.connection_string());
+    mongo::Query lQuery(BSON("filename" << aPath));
+    lQuery.sort(BSON("uploadDate" << -1));
+    mongo::BSONObj lFile = lConnection->findOne(
+        files_collection(),
+        lQuery,
+        &FilesystemEntry::statFields());
+    lConnection.done();
+
+    pthread_rwlock_wrlock(&theLock);
+    if (lFile.isEmpty())
+      remove(theRoot, theIds, aPath);
+    else
+      set(theRoot, theIds, aPath, Record(lFile), true);
+    pthread_rwlock_unlock(&theLock);
+  }
+
+  void
+  NamespaceIndex::removeTree(const std::string& aPath)
+  {
+    {
+      // same as move, the running scan might have read them already
+      gridfs::Lock lLock(theLoadMutex);
+      if (theLoading)
+        theStale = true;
+    }
+
+    if (!theReady)
+      return;
+
+    pthread_rwlock_wrlock(&theLock);
+    Node* lNode = detach(theRoot, aPath);
+    if (lNode)
+    {
+      unindexTree(theIds, lNode);
+      delete lNode;
+    }
+    pthread_rwlock_unlock(&theLock);
+  }
+
+  void
+  NamespaceIndex::move(const std::string& aOldPath, const std::string& aNewPath)
+  {
+    {
+      // the running scan might have read the entries at their old
+      // paths, i.e. it has to start over
+      gridfs::Lock lLock(theLoadMutex);
+      if (theLoading)
+        theStale = true;
+    }
+
+    if (!theReady)
+      return;
+
+    pthread_rwlock_wrlock(&theLock);
+    Node* lNode = detach(theRoot, aOldPath);
+    if (lNode)
+    {
+      // replaces whatever was there before
+      remove(theRoot, theIds, aNewPath);
+      Node* lNew = findOrCreate(theRoot, aNewPath);
+      if (lNew)
+      {
+        std::swap(lNew->theChildren, lNode->theChildren);
+        std::swap(lNew->theRecord, lNode->theRecord);
+        std::swap(lNew->theExists, lNode->theExists);
+
+        for (size_t i = 0; i < lNew->theChildren.size(); ++i)
+          lNew->theChildren[i]->theParent = lNew;
+        if (lNew->theExists && lNew->theRecord.theId != mongo::OID())
+          theIds[lNew->theRecord.theId] = lNew;
+      }
+      // whatever was below aNewPath before
+      unindexTree(theIds, lNode);
+      delete lNode;
+    }
+    pthread_rwlock_unlock(&theLock);
+  }
+
+  std::string
+  NamespaceIndex::pathOf(const mongo::OID& aId)
+  {
+    std::string lPath;
+    if (!theReady)
+      return lPath;
+
+    pthread_rwlock_rdlock(&theLock);
+    Ids::const_iterator lIt = theIds.find(aId);
+    if (lIt != theIds.end())
+    {
+      std::vector<const Node*> lNodes;
+      for (const Node* lNode = lIt->second; lNode != theRoot; lNode = lNode->theParent)
+        lNodes.push_back(lNode);
+      for (size_t i = lNodes.size(); i > 0; --i)
+        lPath.append("/").append(lNodes[i - 1]->theName);
+    }
+    pthread_rwlock_unlock(&theLock);
+    return lPath;
+  }
+
+  void
+  NamespaceIndex::unindex(Ids& aIds, const Node* aNode)
+  {
+    if (!aNode->theExists)
+      return;
+
+    // another node might have the id already, e.g. after
+    // the new path of a renamed file has been refreshed
+    Ids::iterator lIt = aIds.find(aNode->theRecord.theId);
+    if (lIt != aIds.end() && lIt->second == aNode)
+      aIds.erase(lIt);
+  }
+
+  void
+  NamespaceIndex::unindexTree(Ids& aIds, const Node* aNode)
+  {
+    unindex(aIds, aNode);
+    for (size_t i = 0; i < aNode->theChildren.size(); ++i)
+      unindexTree(aIds, aNode->theChildren[i]);
+  }
+
+  NamespaceIndex::Node*
+  NamespaceIndex::find(Node* aRoot, const std::string& aPath)
+  {
+    if (aPath.empty())
+      return aRoot;
+    if (aPath[0] != '/')
+      return 0;
+
+    Node* lNode = aRoot;
+    size_t lStart = 1;
+    for (;;)
+    {
+      size_t lEnd = aPath.find('/', lStart);
+      if (lEnd == std::string::npos)
+        lEnd = aPath.size();
+      std::string lName = aPath.substr(lStart, lEnd - lStart);
+
+      std::vector<Node*>::const_iterator lIt = std::lower_bound(
+          lNode->theChildren.begin(), lNode->theChildren.end(), lName, NodeName());
+      if (lIt == lNode->theChildren.end() || (*lIt)->theName != lName)
+        return 0;
+
+      lNode = *lIt;
+      if (lEnd == aPath.size())
+        return lNode;
+      lStart = lEnd + 1;
+    }
+  }
+
+  NamespaceIndex::Node*
+  NamespaceIndex::findOrCreate(Node* aRoot, const std::string& aPath)
+  {
+    if (aPath.empty())
+      return aRoot;
+    if (aPath[0] != '/')
+      return 0;
+
+    Node* lNode = aRoot;
+    size_t lStart = 1;
+    for (;;)
+    {
+      size_t lEnd = aPath.find('/', lStart);
+      if (lEnd == std::string::npos)
+        lEnd = aPath.size();
+      std::string lName = aPath.substr(lStart, lEnd - lStart);
+
+      std::vector<Node*>::iterator lIt = std::lower_bound(
+          lNode->theChildren.begin(), lNode->theChildren.end(), lName, NodeName());
+      if (lIt == lNode->theChildren.end() || (*lIt)->theName != lName)
+        lIt = lNode->theChildren.insert(lIt, new Node(lName, lNode));
+
+      lNode = *lIt;
+      if (lEnd == aPath.size())
+        return lNode;
+      lStart = lEnd + 1;
+    }
+  }
+
+  void
+  NamespaceIndex::set(
+      Node* aRoot,
+      Ids& aIds,
+      const std::string& aPath,
+      const Record& aRecord,
+      bool aReplace)
+  {
+    Node* lNode = findOrCreate(aRoot, aPath);
+    if (!lNode)
+      return;
+
+    // the latest version wins while loading
+    if (aReplace || !lNode->theExists ||
+        lNode->theRecord.theUploadDate <= aRecord.theUploadDate)
+    {
+      unindex(aIds, lNode);
+      lNode->theRecord = aRecord;
+      lNode->theExists = true;
+      if (aRecord.theId != mongo::OID())
+        aIds[aRecord.theId] = lNode;
+    }
+  }
+
+  NamespaceIndex::Node*
+  NamespaceIndex::detach(Node* aRoot, const std::string& aPath)
+  {
+    std::string lParentPath;
+    if (!FilesystemEntry::parentPath(aPath, lParentPath))
+      return 0;
+
+    Node* lParent = find(aRoot, lParentPath);
+    if (!lParent)
+      return 0;
+
+    std::string lName = aPath.substr(lParentPath.size() + 1);
+    std::vector<Node*>::iterator lIt = std::lower_bound(
+        lParent->theChildren.begin(), lParent->theChildren.end(), lName, NodeName());
+    if (lIt == lParent->theChildren.end() || (*lIt)->theName != lName)
+      return 0;
+
+    Node* lNode = *lIt;
+    lParent->theChildren.erase(lIt);
+    return lNode;
+  }
+
+  void
+  NamespaceIndex::remove(Node* aRoot, Ids& aIds, const std::string& aPath)
+  {
+    Node* lNode = find(aRoot, aPath);
+    if (!lNode)
+      return;
+    unindex(aIds, lNode);
+    lNode->theExists = false;
+
+    // drop nodes that neither exist nor have children, bottom up
+    std::string lPath = aPath;
+    while (lNode != aRoot && !lNode->theExists && lNode->theChildren.empty())
+    {
+      std::string lName = lNode->theName;
+      FilesystemEntry::parentPath(lPath, lPath);
+      Node* lParent = find(aRoot, lPath);
+
+      std::vector<Node*>::iterator lIt = std::lower_bound(
+          lParent->theChildren.begin(), lParent->theChildren.end(), lName, NodeName());
+      lParent->theChildren.erase(lIt);
+      delete lNode;
+
+      lNode = lParent;
+    }
+  }
+
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <mongo/client/redef_macros.h> //To fix ill-defined macros
+#include <mongo/client/dbclient.h>
+
+#include "gridfs_fuse.h"
+
+namespace gridfs {
+
+  /**
+   * in-process index of the complete namespace of the mount, i.e. the
+   * attributes of every entry, which answers getattr, opendir, readdir
+   * and the emptiness check of rmdir without asking mongo or memcached.
+   *
+   * The entries are stored in a tree of path components such that the
+   * common prefixes of paths are stored only once and every entry only
+   * keeps a packed record of its attributes.
+   *
+   * The index is loaded in the background by scanning the files
+   * collection with several threads, each reading a range of _ids.
+   * Until it's loaded, all lookups return UNKNOWN. Afterwards, it's
+   * kept current by refreshing every path that's changed by this mount
+   * or, with oplog_tail, any other mount (see Memcache::remove and
+   * OplogTailer::evict).
+   */
+  class NamespaceIndex
+  {
+    public:
+      NamespaceIndex(unsigned int aThreads);
+
+      ~NamespaceIndex();
+
+      // (re)loads the index in the background, the current content
+      // is used until the new one is complete
+      void
+      reload();
+
+      bool
+      ready() const { return theReady; }
+
+      Memcache::Result
+      get(const std::string& aPath, struct stat* aBuf);
+
+      // the entries of the directory aDir, null if it's not known
+      Memcache::Listing
+      list(const std::string& aDir);
+
+      // false if nothing is known about aDir
+      bool
+      isEmpty(const std::string& aDir, bool& aEmpty);
+
+      // reads the latest version of aPath from mongo
+      void
+      refresh(const std::string& aPath);
+
+      // moves aOldPath and everything below to aNewPath
+      void
+      move(const std::string& aOldPath, const std::string& aNewPath);
+
+      // removes aPath and everything below
+      void
+      removeTree(const std::string& aPath);
+
+      // the path of the files document with the given id,
+      // empty if it's unknown
+      std::string
+      pathOf(const mongo::OID& aId);
+
+    private:
+      // packed attributes of an entry
+      struct Record
+      {
+        Record();
+
+        Record(const mongo::BSONObj& aFile);
+
+        void
+        toStat(struct stat* aBuf) const;
+
+        // nanoseconds
+        long long theAtime;
+        long long theMtime;
+        long long theCtime;
+        long long theSize;
+        long long theBlocks;
+        // milliseconds, the latest version of a path wins
+        long long theUploadDate;
+        mongo::OID theId;
+        mode_t theMode;
+        uid_t theUid;
+        gid_t theGid;
+      };
+
+      struct Node
+      {
+        Node(const std::string& aName, Node* aParent)
+          : theName(aName),
+            theParent(aParent),
+            theExists(false)
+        {}
+
+        ~Node();
+
+        std::string        theName;
+        // null for the root
+        Node*              theParent;
+        // sorted by name
+        std::vector<Node*> theChildren;
+        Record             theRecord;
+        // false for nodes only created as parent of existing ones
+        bool               theExists;
+      };
+
+      typedef std::vector<std::pair<std::string, Record> > Records;
+
+      struct IdHash
+      {
+        size_t
+        operator()(const mongo::OID& aId) const
+        {
+          return boost::hash_range(aId.getData(), aId.getData() + 12);
+        }
+      };
+
+      // the existing node of each files document with an ObjectId
+      typedef boost::unordered_map<mongo::OID, Node*, IdHash> Ids;
+
+      struct Scan
+      {
+        NamespaceIndex* theIndex;
+        mongo::BSONObj  theQuery;
+        pthread_t       theThread;
+      };
+
+      static void*
+      runLoad(void* aIndex);
+
+      static void*
+      runScan(void* aScan);
+
+      void
+      load();
+
+      void
+      scan(const mongo::BSONObj& aQuery);
+
+      // the query of each scan thread
+      std::vector<mongo::BSONObj>
+      partition(mongo::DBClientBase& aConnection);
+
+      static Node*
+      find(Node* aRoot, const std::string& aPath);
+
+      static Node*
+      findOrCreate(Node* aRoot, const std::string& aPath);
+
+      // aReplace: the record is the latest version
+      // otherwise: the record wins if it's newer
+      static void
+      set(
+          Node* aRoot,
+          Ids& aIds,
+          const std::string& aPath,
+          const Record& aRecord,
+          bool aReplace);
+
+      static void
+      remove(Node* aRoot, Ids& aIds, const std::string& aPath);
+
+      // removes the node of aPath from its parent without deleting it
+      static Node*
+      detach(Node* aRoot, const std::string& aPath);
+
+      // removes the id of aNode if it's indexed for aNode
+      static void
+      unindex(Ids& aIds, const Node* aNode);
+
+      // same for aNode and everything below
+      static void
+      unindexTree(Ids& aIds, const Node* aNode);
+
+      // forbid copying
+      NamespaceIndex(const NamespaceIndex&);
+      NamespaceIndex& operator=(const NamespaceIndex&);
+
+      unsigned int     theThreads;
+      pthread_rwlock_t theLock;
+      Node*            theRoot;
+      Ids              theIds;
+      volatile bool    theReady;
+
+      // protects the following members
+      pthread_mutex_t  theLoadMutex;
+      pthread_t        theLoader;
+      bool             theLoading;
+      bool             theJoinable;
+      bool             theScanFailed;
+      // a subtree has been moved while loading
+      bool             theStale;
+      volatile bool    theStopped;
+      // records read by the scan threads
+      Records          theLoaded;
+      // paths refreshed while loading, they are refreshed again
+      // once the loaded content replaces the current one
+      std::set<std::string> theDirty;
+  };
+
+}
@@ -0,0 +1,331 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "oplog_tailer.h"
+
+#include <unistd.h>
+#include <stdexcept>
+#include <syslog.h>
+#include <mongo/client/connpool.h>
+
+#include "gridfs_fuse.h"
+#include "attribute_cache.h"
+#include "listing_cache.h"
+#include "namespace_index.h"
+#include "filesystem_entry.h"
+
+namespace gridfs {
+
+  static const char* OPLOG_COLLECTION = "local.oplog.rs";
+
+  // upper bound of remembered filenames
+  static const size_t MAX_FILENAMES = 64 * 1024;
+
+  OplogTailer::OplogTailer()
+    : theStarted(false),
+      theStopped(false)
+  {
+    theFilesCollection = std::string(FUSE.config.mongo_db) + "." +
+      FUSE.config.mongo_collection_prefix + ".files";
+  }
+
+  OplogTailer::~OplogTailer()
+  {
+    stop();
+  }
+
+  void
+  OplogTailer::start()
+  {
+    theStopped = false;
+    if (pthread_create(&theThread, NULL, run, this) != 0)
+    {
+      syslog(LOG_ERR, "oplog: couldn't start thread");
+      return;
+    }
+    theStarted = true;
+  }
+
+  void
+  OplogTailer::stop()
+  {
+    if (!theStarted)
+      return;
+
+    theStopped = true;
+    pthread_join(theThread, NULL);
+    theStarted = false;
+  }
+
+  void*
+  OplogTailer::run(void* aTailer)
+  {
+    static_cast<OplogTailer*>(aTailer)->tail();
+    return NULL;
+  }
+
+  void
+  OplogTailer::tail()
+  {
+    mongo::BSONObj lLast;
+
+    while (!theStopped)
+    {
+      try
+      {
+        mongo::ScopedDbConnection lConnection(FUSE.connection_string());
+
+        // start at the end, changes made before are already
+        // reflected in memcached or unknown to this mount
+        if (lLast.isEmpty())
+          lLast = latest(*lConnection.get());
+        else if (behind(*lConnection.get(), lLast))
+        {
+          // the last processed entry isn't in the capped oplog anymore,
+          // i.e. changes might have been missed
+          syslog(LOG_WARNING, "oplog: fell behind the oplog, evicting everything");
+          evictAll();
+          if (FUSE.namespaceIndex())
+            FUSE.namespaceIndex()->reload();
+        }
+
+        // $gte because a tailable cursor without any result is dead
+        // right away, i.e. the last processed entry is returned again
+        mongo::BSONObjBuilder lTs;
+        lTs.appendAs(lLast["ts"], "$gte");
+        mongo::BSONObj lQuery = BSON(
+            "ts" << lTs.obj() <<
+            "ns" << theFilesCollection);
+
+        std::auto_ptr<mongo::DBClientCursor> lCursor = lConnection->query(
+            OPLOG_COLLECTION,
+            lQuery,
+            0, 0, 0,
+            mongo::QueryOption_CursorTailable |
+            mongo::QueryOption_AwaitData |
+            mongo::QueryOption_OplogReplay);
+
+        bool lFirst = true;
+        while (!theStopped && !lCursor->isDead())
+        {
+          // AwaitData blocks a few seconds on the server if there's nothing new
+          if (!lCursor->more())
+            continue;
+
+          // the last entry is only returned again if it was one of the
+          // files collection, the latest of the whole oplog usually isn't
+          mongo::BSONObj lEntry = lCursor->next();
+          if (lFirst)
+          {
+            lFirst = false;
+            if (lEntry["ts"]._opTime().asDate() == lLast["ts"]._opTime().asDate())
+              continue;
+          }
+
+          process(*lConnection.get(), lEntry);
+          lLast = BSON("ts" << lEntry["ts"]);
+        }
+
+        // the cursor is killed through the connection
+        lCursor.reset();
+        lConnection.done();
+      }
+      catch (std::exception& e)
+      {
+        syslog(LOG_ERR, "oplog: %s", e.what());
+      }
+
+      // resume after the last processed entry
+      if (!theStopped)
+        sleep(1);
+    }
+  }
+
+  mongo::BSONObj
+  OplogTailer::latest(mongo::DBClientBase& aConnection)
+  {
+    static const mongo::BSONObj lFields = BSON("ts" << 1);
+    mongo::Query lQuery;
+    lQuery.sort(BSON("$natural" << -1));
+
+    mongo::BSONObj lLatest = aConnection.findOne(OPLOG_COLLECTION, lQuery, &lFields);
+    if (lLatest.isEmpty())
+      throw std::runtime_error("no oplog found, is mongo running as replica set?");
+    return lLatest.getOwned();
+  }
+
+  bool
+  OplogTailer::behind(mongo::DBClientBase& aConnection, const mongo::BSONObj& aLast)
+  {
+    static const mongo::BSONObj lFields = BSON("ts" << 1);
+    mongo::Query lQuery;
+    lQuery.sort(BSON("$natural" << 1));
+
+    mongo::BSONObj lOldest = aConnection.findOne(OPLOG_COLLECTION, lQuery, &lFields);
+    return lOldest.isEmpty() ||
+      lOldest["ts"]._opTime().asDate() > aLast["ts"]._opTime().asDate();
+  }
+
+  void
+  OplogTailer::process(mongo::DBClientBase& aConnection, const mongo::BSONObj& aEntry)
+  {
+    std::string lOp = aEntry.getStringField("op");
+    mongo::BSONObj lObj = aEntry["o"].Obj();
+
+    bool lUnlinked = lOp == "u" && lObj["$set"].isABSONObj() &&
+      lObj["$set"].Obj()["unlinked"].type() == mongo::String;
+    if (!lUnlinked)
+      theLastUnlinked.clear();
+
+    if (lOp == "i")
+    {
+      std::string lFilename = lObj.getStringField("filename");
+      remember(lObj["_id"], lFilename);
+      evict(lFilename);
+    }
+    else if (lUnlinked)
+    {
+      // marked as unlinked (see FilesystemEntry::unlink), the
+      // Unlinker's delete later on doesn't need to evict anything
+      remember(aEntry["o2"].Obj()["_id"], "");
+
+      // all documents of a removed subtree carry the path of its root
+      std::string lPath = lObj["$set"].Obj()["unlinked"].str();
+      if (lPath == theLastUnlinked)
+        return;
+      theLastUnlinked = lPath;
+
+      if (FUSE.namespaceIndex())
+        FUSE.namespaceIndex()->removeTree(lPath);
+      evict(lPath);
+      return;
+    }
+    else if (lOp == "u" && renamed(aEntry))
+    {
+      // renamed by another mount (see FilesystemEntry::rename), mongo
+      // only knows the new name, the old one has to be remembered
+      mongo::BSONElement lId = aEntry["o2"].Obj()["_id"];
+      std::string lNewName = lObj["$set"].Obj()["filename"].str();
+
+      std::string lOldName;
+      Filenames::const_iterator lIt = theFilenames.find(lId.toString());
+      if (lIt != theFilenames.end())
+        lOldName = lIt->second;
+      else if (FUSE.namespaceIndex() && lId.type() == mongo::jstOID)
+        lOldName = FUSE.namespaceIndex()->pathOf(lId.OID());
+
+      if (lOldName.empty())
+        evictAll();
+      else if (lOldName != lNewName)
+      {
+        if (FUSE.namespaceIndex())
+          FUSE.namespaceIndex()->move(lOldName, lNewName);
+        evict(lOldName);
+      }
+      evict(lNewName);
+      remember(lId, lNewName);
+    }
+    else if (lOp == "u")
+    {
+      std::string lFilename = filename(aConnection, aEntry["o2"].Obj()["_id"]);
+      if (lFilename.empty())
+        evictAll();
+      else
+        evict(lFilename);
+    }
+    else if (lOp == "d")
+    {
+      Filenames::iterator lIt = theFilenames.find(lObj["_id"].toString());
+      if (lIt == theFilenames.end())
+      {
+        // the namespace index knows the ids of all entries
+        std::string lFilename;
+        if (FUSE.namespaceIndex() && lObj["_id"].type() == mongo::jstOID)
+          lFilename = FUSE.namespaceIndex()->pathOf(lObj["_id"].OID());
+
+        if (lFilename.empty())
+          evictAll();
+        else
+          evict(lFilename);
+      }
+      else
+      {
+        if (!lIt->second.empty())
+          evict(lIt->second);
+        theFilenames.erase(lIt);
+      }
+    }
+  }
+
+  bool
+  OplogTailer::renamed(const mongo::BSONObj& aEntry)
+  {
+    mongo::BSONElement lSet = aEntry["o"].Obj()["$set"];
+    return lSet.isABSONObj() && lSet.Obj()["filename"].type() == mongo::String;
+  }
+
+  std::string
+  OplogTailer::filename(mongo::DBClientBase& aConnection, const mongo::BSONElement& aId)
+  {
+    Filenames::const_iterator lIt = theFilenames.find(aId.toString());
+    if (lIt != theFilenames.end())
+      return lIt->second;
+
+    static const mongo::BSONObj lFields = BSON("filename" << 1);
+    mongo::BSONObjBuilder lQuery;
+    lQuery.appendAs(aId, "_id");
+
+    mongo::BSONObj lFile = aConnection.findOne(theFilesCollection, lQuery.obj(), &lFields);
+    if (lFile.isEmpty())
+      return "";
+
+    std::string lFilename = lFile.getStringField("filename");
+    remember(aId, lFilename);
+    return lFilename;
+  }
+
+  void
+  OplogTailer::remember(const mongo::BSONElement& aId, const std::string& aFilename)
+  {
+    if (theFilenames.size() >= MAX_FILENAMES)
+      theFilenames.clear();
+    theFilenames[aId.toString()] = aFilename;
+  }
+
+  void
+  OplogTailer::evict(const std::string& aFilename)
+  {
+    syslog(LOG_DEBUG, "oplog: evicting %s", aFilename.c_str());
+
+    // the mount that made the change has already invalidated memcached,
+    // only what's kept in this process is stale
+    FUSE.attributes()->remove(aFilename);
+    std::string lDir;
+    if (FilesystemEntry::parentPath(aFilename, lDir))
+      FUSE.listings()->remove(lDir);
+
+    NamespaceIndex* lIndex = FUSE.namespaceIndex();
+    if (lIndex)
+    {
+      try
+      {
+        lIndex->refresh(aFilename);
+      }
+      catch (std::exception& e)
+      {
+        syslog(LOG_ERR, "oplog: refreshing namespace index for %s failed: %s",
+            aFilename.c_str(), e.what());
+        lIndex->reload();
+      }
+    }
+  }
+
+  void
+  OplogTailer::evictAll()
+  {
+    syslog(LOG_DEBUG, "oplog: evicting all in-process entries");
+    FUSE.attributes()->clear();
+    FUSE.listings()->clear();
+  }
+
+}
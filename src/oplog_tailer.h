@@ -0,0 +1,94 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <string>
+#include <boost/unordered_map.hpp>
+
+#include <mongo/client/redef_macros.h> //To fix ill-defined macros
+#include <mongo/client/dbclient.h>
+
+namespace gridfs {
+
+  /**
+   * background thread which tails the oplog of the replica set for
+   * changes of the files collection made by any mount and evicts the
+   * cached attributes and listings of the affected paths.
+   *
+   * Changes of the chunks collection don't need to be followed because
+   * content is only ever changed together with its files document.
+   * Oplog entries only identify updated or removed documents by _id.
+   * The filenames of recently seen ids are remembered, for all others
+   * the in-process caches are cleared completely. That includes the
+   * old name of a renamed document, mongo only knows the new one.
+   */
+  class OplogTailer
+  {
+    public:
+      OplogTailer();
+
+      ~OplogTailer();
+
+      void
+      start();
+
+      // waits for the thread to finish its current getMore
+      void
+      stop();
+
+    private:
+      static void*
+      run(void* aTailer);
+
+      void
+      tail();
+
+      // the timestamp of the latest oplog entry
+      mongo::BSONObj
+      latest(mongo::DBClientBase& aConnection);
+
+      // the entry aLast isn't in the oplog anymore
+      bool
+      behind(mongo::DBClientBase& aConnection, const mongo::BSONObj& aLast);
+
+      void
+      process(mongo::DBClientBase& aConnection, const mongo::BSONObj& aEntry);
+
+      // the update sets a new filename
+      bool
+      renamed(const mongo::BSONObj& aEntry);
+
+      // the filename of the files document aId, empty if unknown
+      std::string
+      filename(mongo::DBClientBase& aConnection, const mongo::BSONElement& aId);
+
+      void
+      remember(const mongo::BSONElement& aId, const std::string& aFilename);
+
+      void
+      evict(const std::string& aFilename);
+
+      void
+      evictAll();
+
+      // forbid copying
+      OplogTailer(const OplogTailer&);
+      OplogTailer& operator=(const OplogTailer&);
+
+      typedef boost::unordered_map<std::string, std::string> Filenames;
+
+      pthread_t   theThread;
+      bool        theStarted;
+      volatile bool theStopped;
+      std::string theFilesCollection;
+
+      // (_id, filename) of recently inserted or updated documents
+      Filenames   theFilenames;
+
+      // the path of the previous entry if it was marked as unlinked
+      std::string theLastUnlinked;
+  };
+
+}
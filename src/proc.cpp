@@ -3,13 +3,15 @@
  */
 #include "gridfs_fuse.h"
 #include "proc.h"
+#include "filesystem_entry.h"
+#include "namespace_index.h"
+#include "memcache_ring.h"
 
+#include <errno.h>
 #include <syslog.h>
 #include <cassert>
 #include <sstream>
 #include <stdlib.h>
-#include <libmemcached/memcached.h>
-#include <libmemcached/util/pool.h>
 
 namespace gridfs {
 
@@ -22,6 +24,7 @@ namespace gridfs {
     {
     case ROOT:
       filler(buf, "instances", NULL, 0);
+      filler(buf, "rmtree", NULL, 0);
       break;
     case INSTANCES:
       listServers(buf, filler);
@@ -34,19 +37,12 @@ namespace gridfs {
   void
   Proc::listServers(void* buf, fuse_fill_dir_t filler) const
   {
-    memcached_st* lMaster = FUSE.master();
-    uint32_t lNumServers = memcached_server_count(lMaster);
-    for (uint32_t i = 0; i < lNumServers; ++i)
-    {
-      memcached_server_instance_st lInstance =
-        memcached_server_instance_by_position(lMaster, i);
-      std::ostringstream lServerName;
-      lServerName
-        << memcached_server_name(lInstance)
-        << ":"
-        << memcached_server_port(lInstance);
-      filler(buf, lServerName.str().c_str(), NULL, 0);
-    }
+    std::vector<std::string> lServers;
+    FUSE.ring()->servers(lServers);
+    for (std::vector<std::string>::const_iterator lIt = lServers.begin();
+         lIt != lServers.end();
+         ++lIt)
+      filler(buf, lIt->c_str(), NULL, 0);
   }
 
   void
@@ -61,6 +57,9 @@ namespace gridfs {
     case LIST_INSTANCES:
       aStBuf->st_mode  = S_IFREG | 0000;
       break;
+    case RMTREE:
+      aStBuf->st_mode  = S_IFREG | 0200;
+      break;
     default: assert(false);
     }
 
@@ -71,39 +70,92 @@ namespace gridfs {
   bool
   Proc::create()
   {
-    std::string lNewServer = thePath.substr(thePrefixLength);
-    int lNewPort = 11211;
+    // there is nothing to create, it's only written to
+    if (theType == RMTREE)
+      return true;
+
+    std::string lNewServer;
+    int lNewPort;
+    if (!server(lNewServer, lNewPort))
+      return false;
+
+    syslog(LOG_DEBUG, "adding server %s and port %i",
+        lNewServer.c_str(), lNewPort);
+
+    return FUSE.ring()->add(lNewServer, lNewPort);
+  }
+
+  int
+  Proc::remove()
+  {
+    std::string lServer;
+    int lPort;
+    if (theType != LIST_INSTANCES)
+      return -EPERM;
+    if (!server(lServer, lPort))
+      return -ENOENT;
+
+    syslog(LOG_DEBUG, "removing server %s and port %i",
+        lServer.c_str(), lPort);
+
+    return FUSE.ring()->remove(lServer, lPort) ? 0 : -ENOENT;
+  }
+
+  bool
+  Proc::server(std::string& aHost, int& aPort) const
+  {
+    aHost = thePath.substr(thePrefixLength);
+    aPort = 11211;
 
-    size_t lIndexOfColon = lNewServer.find_last_of(':');
+    size_t lIndexOfColon = aHost.find_last_of(':');
     if (lIndexOfColon != std::string::npos)
     {
-      if (lIndexOfColon >= lNewServer.length() - 1)
+      if (lIndexOfColon >= aHost.length() - 1)
         return false;
 
-      std::string lTmp = lNewServer.substr(lIndexOfColon + 1);
-      lNewServer = lNewServer.substr(0, lIndexOfColon);
-      lNewPort = atoi(lTmp.c_str());
+      std::string lTmp = aHost.substr(lIndexOfColon + 1);
+      aHost = aHost.substr(0, lIndexOfColon);
+      aPort = atoi(lTmp.c_str());
     }
+    return !aHost.empty();
+  }
 
-    syslog(LOG_DEBUG, "adding server %s and port %i",
-        lNewServer.c_str(), lNewPort);
+  int
+  Proc::write(const char* aData, size_t aSize)
+  {
+    if (theType != RMTREE)
+      return -EPERM;
 
-    memcached_st* lMaster = FUSE.master();
-    uint32_t lNumServers = memcached_server_count(lMaster);
-    for (uint32_t i = 0; i < lNumServers; ++i)
-    {
-      memcached_server_instance_st lInstance =
-        memcached_server_instance_by_position(lMaster, i);
+    // e.g. "echo /some/dir > proc/rmtree"
+    std::string lRelative(aData, aSize);
+    while (!lRelative.empty() &&
+        (lRelative[lRelative.size() - 1] == '\n' || lRelative[lRelative.size() - 1] == '/'))
+      lRelative.resize(lRelative.size() - 1);
 
-      const char* lName = memcached_server_name(lInstance);
-      int lPort =  memcached_server_port(lInstance);
+    // neither the root nor proc itself
+    if (lRelative.empty() || lRelative[0] != '/' ||
+        lRelative == "/proc" || lRelative.compare(0, 6, "/proc/") == 0)
+      return -EINVAL;
 
-      if (lNewServer == lName && lNewPort == lPort)
-        return false;
-    }
-    memcached_pool_st* lPool = FUSE.pool();
-    memcached_server_add(lMaster, lNewServer.c_str(), lNewPort);
-    return true;
+    std::string lPath = std::string(FUSE.config.path_prefix) + lRelative;
+    syslog(LOG_INFO, "rmtree: removing %s", lPath.c_str());
+
+    FilesystemEntry lEntry(lPath);
+    std::vector<std::string> lRemoved;
+    if (!lEntry.removeTree(lRemoved))
+      return -ENOENT;
+
+    NamespaceIndex* lIndex = FUSE.namespaceIndex();
+    if (lIndex)
+      lIndex->removeTree(lPath);
+
+    lRemoved.push_back(lPath);
+    Memcache m;
+    m.invalidate(lRemoved);
+
+    syslog(LOG_INFO, "rmtree: removed %s and %u entries below",
+        lPath.c_str(), (unsigned int)lRemoved.size() - 1);
+    return (int)aSize;
   }
 
 }
@@ -25,6 +25,8 @@ namespace gridfs {
         = std::string(FUSE.config.path_prefix) + "/proc/instances";
       static std::string lProcInstList
         = std::string(FUSE.config.path_prefix) + "/proc/instances/";
+      static std::string lProcRmtree
+        = std::string(FUSE.config.path_prefix) + "/proc/rmtree";
 
       // needed for substr
       thePrefixLength = lProcInstList.length();
@@ -35,6 +37,8 @@ namespace gridfs {
         theType = INSTANCES;
       else if (aPath.find(lProcInstList) == 0)
         theType = LIST_INSTANCES;
+      else if (aPath == lProcRmtree)
+        theType = RMTREE;
     }
 
     void
@@ -46,16 +50,29 @@ namespace gridfs {
     bool
     create();
 
+    // removes the memcached server of an entry in instances
+    int
+    remove();
+
+    // the content written to rmtree is the path (relative to the mount)
+    // of a file or directory which is removed with everything below
+    int
+    write(const char* aData, size_t aSize);
 
   private:
     void
     listServers(void* buf, fuse_fill_dir_t filler) const;
 
+    // the host and port of an entry in instances
+    bool
+    server(std::string& aHost, int& aPort) const;
+
     enum Type
     {
       ROOT = 0,
       INSTANCES = 1,
-      LIST_INSTANCES = 2
+      LIST_INSTANCES = 2,
+      RMTREE = 3
     } theType;
 
     const std::string thePath;
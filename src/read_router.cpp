@@ -0,0 +1,249 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "read_router.h"
+
+#include <errno.h>
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+#include <syslog.h>
+#include <sys/time.h>
+#include <vector>
+#include <mongo/client/connpool.h>
+
+#include "gridfs_fuse.h"
+#include "filesystem_entry.h"
+#include "lock.h"
+
+namespace gridfs {
+
+  bool
+  ReadRouter::parse(const std::string& aName, mongo::ReadPreference& aPreference)
+  {
+    if (aName == "primary")
+      aPreference = mongo::ReadPreference_PrimaryOnly;
+    else if (aName == "primaryPreferred")
+      aPreference = mongo::ReadPreference_PrimaryPreferred;
+    else if (aName == "secondary")
+      aPreference = mongo::ReadPreference_SecondaryOnly;
+    else if (aName == "secondaryPreferred")
+      aPreference = mongo::ReadPreference_SecondaryPreferred;
+    else if (aName == "nearest")
+      aPreference = mongo::ReadPreference_Nearest;
+    else
+      return false;
+    return true;
+  }
+
+  ReadRouter::ReadRouter(mongo::ReadPreference aPreference, unsigned int aMaxStaleness)
+    : theReadPreference(aPreference),
+      theMaxStaleness(aMaxStaleness),
+      theStarted(false),
+      theStopped(false),
+      theLagging(true)
+  {
+    pthread_mutex_init(&theMutex, NULL);
+    pthread_cond_init(&theCondition, NULL);
+  }
+
+  ReadRouter::~ReadRouter()
+  {
+    stop();
+    pthread_cond_destroy(&theCondition);
+    pthread_mutex_destroy(&theMutex);
+  }
+
+  void
+  ReadRouter::start()
+  {
+    theStopped = false;
+    if (pthread_create(&theThread, NULL, run, this) != 0)
+    {
+      syslog(LOG_ERR, "read router: couldn't start thread");
+      return;
+    }
+    theStarted = true;
+  }
+
+  void
+  ReadRouter::stop()
+  {
+    if (!theStarted)
+      return;
+
+    {
+      gridfs::Lock lLock(theMutex);
+      theStopped = true;
+      pthread_cond_signal(&theCondition);
+    }
+    pthread_join(theThread, NULL);
+    theStarted = false;
+  }
+
+  int
+  ReadRouter::route(mongo::Query& aQuery, const std::string& aPath)
+  {
+    {
+      gridfs::Lock lLock(theMutex);
+
+      if (theLagging)
+        return 0;
+
+      time_t lNow = time(NULL);
+      expire(lNow);
+
+      if (theWritten.find(aPath) != theWritten.end())
+        return 0;
+
+      if (!theWrittenSubtrees.empty())
+      {
+        std::string lPath = aPath;
+        do
+        {
+          if (theWrittenSubtrees.find(lPath) != theWrittenSubtrees.end())
+            return 0;
+        } while (FilesystemEntry::parentPath(lPath, lPath));
+      }
+    }
+
+    aQuery.readPref(theReadPreference, mongo::BSONArrayBuilder().arr());
+    return mongo::QueryOption_SlaveOk;
+  }
+
+  void
+  ReadRouter::written(const std::string& aPath, bool aSubtree)
+  {
+    time_t lExpires = time(NULL) + theMaxStaleness;
+
+    // the listing of the directory changes as well
+    std::string lParent;
+    bool lHasParent = FilesystemEntry::parentPath(aPath, lParent);
+
+    gridfs::Lock lLock(theMutex);
+
+    (aSubtree ? theWrittenSubtrees : theWritten)[aPath] = lExpires;
+    theExpiry.push_back(std::make_pair(lExpires, std::make_pair(aPath, aSubtree)));
+
+    if (lHasParent)
+    {
+      theWritten[lParent] = lExpires;
+      theExpiry.push_back(std::make_pair(lExpires, std::make_pair(lParent, false)));
+    }
+  }
+
+  void
+  ReadRouter::expire(time_t aNow)
+  {
+    while (!theExpiry.empty() && theExpiry.front().first <= aNow)
+    {
+      const std::string& lPath = theExpiry.front().second.first;
+      Written& lWritten = theExpiry.front().second.second ? theWrittenSubtrees : theWritten;
+
+      // unless it has been written again in the meantime
+      Written::iterator lIt = lWritten.find(lPath);
+      if (lIt != lWritten.end() && lIt->second <= aNow)
+        lWritten.erase(lIt);
+
+      theExpiry.pop_front();
+    }
+  }
+
+  void*
+  ReadRouter::run(void* aRouter)
+  {
+    static_cast<ReadRouter*>(aRouter)->loop();
+    return NULL;
+  }
+
+  void
+  ReadRouter::loop()
+  {
+    const unsigned int lInterval = std::max(theMaxStaleness / 2, 1u);
+    while (true)
+    {
+      bool lLagging = true;
+      try
+      {
+        mongo::ScopedDbConnection lConnection(FUSE.connection_string());
+        long long lLag = lag(*lConnection.get());
+        lConnection.done();
+
+        lLagging = lLag > (long long)theMaxStaleness;
+        if (lLagging)
+          syslog(LOG_INFO, "read router: secondaries lag %lld seconds, reading from the primary",
+              lLag);
+      }
+      catch (std::exception& e)
+      {
+        // better safe than stale
+        syslog(LOG_ERR, "read router: %s", e.what());
+      }
+
+      gridfs::Lock lLock(theMutex);
+      theLagging = lLagging;
+
+      struct timeval lNow;
+      gettimeofday(&lNow, NULL);
+      struct timespec lTimeout;
+      lTimeout.tv_sec = lNow.tv_sec + lInterval;
+      lTimeout.tv_nsec = lNow.tv_usec * 1000;
+
+      while (!theStopped &&
+          pthread_cond_timedwait(&theCondition, &theMutex, &lTimeout) != ETIMEDOUT)
+        ;
+
+      if (theStopped)
+        return;
+    }
+  }
+
+  long long
+  ReadRouter::lag(mongo::DBClientBase& aConnection)
+  {
+    mongo::BSONObj lStatus;
+    if (!aConnection.runCommand("admin", BSON("replSetGetStatus" << 1), lStatus))
+      throw std::runtime_error("replSetGetStatus failed: " + lStatus.toString());
+
+    // hidden members never answer reads and delayed ones lag on
+    // purpose, they would keep all reads on the primary
+    std::set<std::string> lIgnored;
+    mongo::BSONObj lConfig = aConnection.findOne("local.system.replset", mongo::Query());
+    if (lConfig["members"].type() == mongo::Array)
+    {
+      std::vector<mongo::BSONElement> lConfigured = lConfig["members"].Array();
+      for (size_t i = 0; i < lConfigured.size(); ++i)
+      {
+        mongo::BSONObj lMember = lConfigured[i].Obj();
+        if (lMember["hidden"].trueValue() ||
+            lMember["slaveDelay"].numberLong() > 0 ||
+            lMember["secondaryDelaySecs"].numberLong() > 0)
+          lIgnored.insert(lMember.getStringField("host"));
+      }
+    }
+
+    // in milliseconds since the epoch
+    long long lPrimary = -1;
+    long long lOldest = -1;
+    std::vector<mongo::BSONElement> lMembers = lStatus["members"].Array();
+    for (size_t i = 0; i < lMembers.size(); ++i)
+    {
+      mongo::BSONObj lMember = lMembers[i].Obj();
+      std::string lState = lMember.getStringField("stateStr");
+      long long lOptime = lMember["optimeDate"].date().millis;
+
+      if (lState == "PRIMARY")
+        lPrimary = lOptime;
+      else if (lState == "SECONDARY" &&
+          lIgnored.find(lMember.getStringField("name")) == lIgnored.end() &&
+          (lOldest < 0 || lOptime < lOldest))
+        lOldest = lOptime;
+    }
+
+    // without a primary nothing is written, i.e. nothing can be stale
+    if (lPrimary < 0 || lOldest < 0 || lOldest >= lPrimary)
+      return 0;
+    return (lPrimary - lOldest) / 1000;
+  }
+
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <time.h>
+#include <deque>
+#include <string>
+#include <boost/unordered_map.hpp>
+
+#include <mongo/client/redef_macros.h> //To fix ill-defined macros
+#include <mongo/client/dbclient.h>
+
+namespace gridfs {
+
+  /**
+   * decides which replica set member answers a read, given the
+   * read_preference option (e.g. secondaryPreferred or nearest).
+   *
+   * Reads go to the primary nevertheless
+   *   - if a path or one of its ancestors has been changed by this
+   *     mount within the last max_staleness seconds, such that the
+   *     mount reads its own writes (see written),
+   *   - and while any secondary lags more than max_staleness seconds
+   *     behind the primary. The lag is read with replSetGetStatus by a
+   *     background thread every max_staleness / 2 seconds. Hidden and
+   *     delayed members don't count, delayed ones have to be hidden
+   *     such that no read goes to them.
+   *
+   * What's read from a secondary is only cached in-process (see
+   * FilesystemEntry::secondary). In the shared cache, it could replace
+   * what another mount has just invalidated, for good.
+   *
+   * Writes and the reads they depend on (e.g. the emptiness check of
+   * rmdir) always go to the primary.
+   */
+  class ReadRouter
+  {
+    public:
+      // false for an unknown name
+      static bool
+      parse(const std::string& aName, mongo::ReadPreference& aPreference);
+
+      // aMaxStaleness in seconds
+      ReadRouter(mongo::ReadPreference aPreference, unsigned int aMaxStaleness);
+
+      ~ReadRouter();
+
+      void
+      start();
+
+      void
+      stop();
+
+      // adds the read preference to aQuery unless a read of aPath has
+      // to go to the primary, returns the query options to use with it
+      int
+      route(mongo::Query& aQuery, const std::string& aPath);
+
+      // aPath has been changed, aSubtree if everything below has
+      // been changed as well (e.g. by rename)
+      void
+      written(const std::string& aPath, bool aSubtree = false);
+
+    private:
+      // expiry of the paths written recently
+      typedef boost::unordered_map<std::string, time_t> Written;
+
+      static void*
+      run(void* aRouter);
+
+      void
+      loop();
+
+      // the largest lag of a secondary in seconds
+      long long
+      lag(mongo::DBClientBase& aConnection);
+
+      // called locked
+      void
+      expire(time_t aNow);
+
+      // forbid copying
+      ReadRouter(const ReadRouter&);
+      ReadRouter& operator=(const ReadRouter&);
+
+      mongo::ReadPreference theReadPreference;
+      unsigned int          theMaxStaleness;
+      pthread_t             theThread;
+      bool                  theStarted;
+
+      // protects the following members
+      pthread_mutex_t       theMutex;
+      pthread_cond_t        theCondition;
+      bool                  theStopped;
+      // until the first check, the secondaries might lag
+      bool                  theLagging;
+      Written               theWritten;
+      Written               theWrittenSubtrees;
+      // (expiry, path, subtree) in the order written
+      std::deque<std::pair<time_t, std::pair<std::string, bool> > > theExpiry;
+  };
+
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "statistics.h"
+
+#include <errno.h>
+#include <cstring>
+#include <stdexcept>
+#include <syslog.h>
+#include <sys/time.h>
+#include <mongo/client/connpool.h>
+
+#include "gridfs_fuse.h"
+#include "lock.h"
+
+namespace gridfs {
+
+  // reported by statfs, the chunks don't have a block size
+  static const unsigned long BLOCK_SIZE = 4096;
+
+  // free space and inodes if the capacity isn't known
+  static const unsigned long long UNLIMITED = 1ULL << 50;
+
+  Statistics::Statistics(unsigned int aInterval, unsigned long long aCapacity)
+    : theInterval(aInterval),
+      theCapacity(aCapacity),
+      theStarted(false),
+      theStopped(false),
+      theUsed(0),
+      theFiles(0),
+      theDiskTotal(0),
+      theDiskUsed(0)
+  {
+    const std::string lPrefix = FUSE.config.mongo_collection_prefix;
+    theFilesCollection = lPrefix + ".files";
+    theChunksCollection = lPrefix + ".chunks";
+
+    pthread_mutex_init(&theMutex, NULL);
+    pthread_cond_init(&theCondition, NULL);
+  }
+
+  Statistics::~Statistics()
+  {
+    stop();
+    pthread_cond_destroy(&theCondition);
+    pthread_mutex_destroy(&theMutex);
+  }
+
+  void
+  Statistics::start()
+  {
+    theStopped = false;
+    if (pthread_create(&theThread, NULL, run, this) != 0)
+    {
+      syslog(LOG_ERR, "statistics: couldn't start thread");
+      return;
+    }
+    theStarted = true;
+  }
+
+  void
+  Statistics::stop()
+  {
+    if (!theStarted)
+      return;
+
+    {
+      gridfs::Lock lLock(theMutex);
+      theStopped = true;
+      pthread_cond_signal(&theCondition);
+    }
+    pthread_join(theThread, NULL);
+    theStarted = false;
+  }
+
+  void
+  Statistics::get(struct statvfs* aBuf)
+  {
+    memset(aBuf, 0, sizeof(struct statvfs));
+
+    unsigned long long lUsed, lFiles, lTotal, lFree;
+    {
+      gridfs::Lock lLock(theMutex);
+      lUsed = theUsed;
+      lFiles = theFiles;
+
+      if (theCapacity)
+      {
+        lTotal = theCapacity;
+        lFree = theCapacity > theUsed ? theCapacity - theUsed : 0;
+      }
+      else if (theDiskTotal)
+      {
+        lTotal = theDiskTotal;
+        lFree = theDiskTotal > theDiskUsed ? theDiskTotal - theDiskUsed : 0;
+      }
+      else
+      {
+        lTotal = lUsed + UNLIMITED;
+        lFree = UNLIMITED;
+      }
+    }
+
+    aBuf->f_bsize   = BLOCK_SIZE;
+    aBuf->f_frsize  = BLOCK_SIZE;
+    aBuf->f_blocks  = lTotal / BLOCK_SIZE;
+    aBuf->f_bfree   = lFree / BLOCK_SIZE;
+    aBuf->f_bavail  = lFree / BLOCK_SIZE;
+    // there is no limit on the number of files
+    aBuf->f_files   = lFiles + UNLIMITED;
+    aBuf->f_ffree   = UNLIMITED;
+    aBuf->f_favail  = UNLIMITED;
+    aBuf->f_namemax = 255;
+  }
+
+  void*
+  Statistics::run(void* aStatistics)
+  {
+    static_cast<Statistics*>(aStatistics)->loop();
+    return NULL;
+  }
+
+  void
+  Statistics::loop()
+  {
+    while (true)
+    {
+      try
+      {
+        mongo::ScopedDbConnection lConnection(FUSE.connection_string());
+        refresh(*lConnection.get());
+        lConnection.done();
+      }
+      catch (std::exception& e)
+      {
+        // keep reporting the previous statistics
+        syslog(LOG_ERR, "statistics: %s", e.what());
+      }
+
+      gridfs::Lock lLock(theMutex);
+
+      struct timeval lNow;
+      gettimeofday(&lNow, NULL);
+      struct timespec lTimeout;
+      lTimeout.tv_sec = lNow.tv_sec + theInterval;
+      lTimeout.tv_nsec = lNow.tv_usec * 1000;
+
+      while (!theStopped &&
+          pthread_cond_timedwait(&theCondition, &theMutex, &lTimeout) != ETIMEDOUT)
+        ;
+
+      if (theStopped)
+        return;
+    }
+  }
+
+  void
+  Statistics::refresh(mongo::DBClientBase& aConnection)
+  {
+    const std::string lDb = FUSE.config.mongo_db;
+    mongo::BSONObj lFiles, lChunks, lStats;
+
+    if (!aConnection.runCommand(lDb, BSON("collStats" << theFilesCollection), lFiles))
+      throw std::runtime_error("collStats failed: " + lFiles.toString());
+
+    // the chunks collection doesn't exist before the first file is written
+    aConnection.runCommand(lDb, BSON("collStats" << theChunksCollection), lChunks);
+
+    if (!aConnection.runCommand(lDb, BSON("dbStats" << 1), lStats))
+      throw std::runtime_error("dbStats failed: " + lStats.toString());
+
+    gridfs::Lock lLock(theMutex);
+    theUsed = lFiles["size"].numberLong() + lChunks["size"].numberLong();
+    theFiles = lFiles["count"].numberLong();
+    theDiskTotal = lStats["fsTotalSize"].numberLong();
+    theDiskUsed = lStats["fsUsedSize"].numberLong();
+  }
+
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <sys/statvfs.h>
+#include <string>
+
+#include <mongo/client/redef_macros.h> //To fix ill-defined macros
+#include <mongo/client/dbclient.h>
+
+namespace gridfs {
+
+  /**
+   * background thread which reads the size of the gridfs collections
+   * (collStats) and of the disks of the database (dbStats) every
+   * statfs_interval seconds, such that statfs is answered from memory
+   * and never waits for mongo.
+   *
+   * The capacity is the capacity option if it's set, otherwise the
+   * size of the disks reported by mongo (3.6 and later only), and
+   * unlimited if neither is known.
+   */
+  class Statistics
+  {
+    public:
+      Statistics(unsigned int aInterval, unsigned long long aCapacity);
+
+      ~Statistics();
+
+      void
+      start();
+
+      void
+      stop();
+
+      // the latest statistics, zero usage until they have been read once
+      void
+      get(struct statvfs* aBuf);
+
+    private:
+      static void*
+      run(void* aStatistics);
+
+      void
+      loop();
+
+      void
+      refresh(mongo::DBClientBase& aConnection);
+
+      // forbid copying
+      Statistics(const Statistics&);
+      Statistics& operator=(const Statistics&);
+
+      unsigned int       theInterval;
+      // bytes, 0 if unknown
+      unsigned long long theCapacity;
+      std::string        theFilesCollection;
+      std::string        theChunksCollection;
+      pthread_t          theThread;
+      bool               theStarted;
+
+      // protects the following members
+      pthread_mutex_t    theMutex;
+      pthread_cond_t     theCondition;
+      bool               theStopped;
+      // bytes of the files and chunks collections
+      unsigned long long theUsed;
+      unsigned long long theFiles;
+      // bytes of the disks of the database, 0 if unknown
+      unsigned long long theDiskTotal;
+      unsigned long long theDiskUsed;
+  };
+
+}
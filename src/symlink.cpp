@@ -1,22 +1,42 @@
 #include "symlink.h"
 
-#include <sstream>
-
 namespace gridfs {
 
-  void
-  Symlink::read(char* link, size_t size)
+  bool
+  Symlink::read(std::string& aTarget, struct stat* aBuf)
   {
-    size_t length = gridfile().getContentLength();
-    std::stringstream linkstream;
-    gridfile().write(linkstream);
-    
-    // If the linkname is too long to fit in the buffer, it should be truncated.
-    // The buffer size argument includes the space for the terminating null character.
-    size_t aligned_length = (length >= size)?( size - 1 ):length;
+    const mongo::BSONObj& lFile = file(LINK_FIELDS);
+    if (lFile.isEmpty())
+      return false;
+
+    stat(lFile, aBuf);
 
-    memcpy(link, linkstream.str().c_str(), aligned_length);
-    link[aligned_length] = '\0';
+    // targets are stored inline in the files document
+    mongo::BSONElement inlineData = lFile["data"];
+    if (inlineData.type() == mongo::BinData)
+    {
+      int len;
+      const char* data = inlineData.binData(len);
+      aTarget.assign(data, len);
+    }
+    else
+    {
+      // links created by older versions keep their target in chunks
+      aTarget.clear();
+      mongo::BSONObjBuilder query;
+      query.appendAs(lFile["_id"], "files_id");
+      mongo::Query lQuery = mongo::Query(query.obj()).sort(BSON("n" << 1));
+      int lOptions = route(lQuery);
+      std::auto_ptr<mongo::DBClientCursor> chunks = connection()->query(
+          chunksCollection(), lQuery, 0, 0, 0, lOptions);
+      while (chunks->more())
+      {
+        int len;
+        const char* data = chunks->next()["data"].binData(len);
+        aTarget.append(data, len);
+      }
+    }
+    return true;
   }
 
 }
@@ -12,10 +12,11 @@ namespace gridfs {
     public:
       Symlink(const std::string& aPath) : FilesystemEntry(aPath) {};     
 
-      void
-      read(char* link, size_t size);
+      // reads the target and the attributes of the link with a single
+      // lookup, returns false if the link doesn't exist
+      bool
+      read(std::string& aTarget, struct stat* aBuf);
  
   }; 
 
 }
-
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#include "unlinker.h"
+
+#include <errno.h>
+#include <syslog.h>
+#include <sys/time.h>
+#include <mongo/client/connpool.h>
+
+#include "gridfs_fuse.h"
+#include "filesystem_entry.h"
+#include "lock.h"
+
+namespace gridfs {
+
+  // seconds between looking for documents marked by other mounts
+  static const int UNLINK_INTERVAL = 1;
+
+  Unlinker::Unlinker(size_t aBatchSize)
+    : theBatchSize(aBatchSize),
+      theStarted(false),
+      theWakeup(false),
+      theStopped(false)
+  {
+    theFilesCollection = std::string(FUSE.config.mongo_db) + "." +
+      FUSE.config.mongo_collection_prefix + ".files";
+    theChunksCollection = std::string(FUSE.config.mongo_db) + "." +
+      FUSE.config.mongo_collection_prefix + ".chunks";
+
+    pthread_mutex_init(&theMutex, NULL);
+    pthread_cond_init(&theCondition, NULL);
+  }
+
+  Unlinker::~Unlinker()
+  {
+    stop();
+    pthread_cond_destroy(&theCondition);
+    pthread_mutex_destroy(&theMutex);
+  }
+
+  void
+  Unlinker::start()
+  {
+    theStopped = false;
+    if (pthread_create(&theThread, NULL, run, this) != 0)
+    {
+      syslog(LOG_ERR, "unlinker: couldn't start thread");
+      return;
+    }
+    theStarted = true;
+  }
+
+  void
+  Unlinker::stop()
+  {
+    if (!theStarted)
+      return;
+
+    {
+      gridfs::Lock lLock(theMutex);
+      theStopped = true;
+      pthread_cond_signal(&theCondition);
+    }
+    pthread_join(theThread, NULL);
+    theStarted = false;
+  }
+
+  void
+  Unlinker::wakeup()
+  {
+    gridfs::Lock lLock(theMutex);
+    theWakeup = true;
+    pthread_cond_signal(&theCondition);
+  }
+
+  void*
+  Unlinker::run(void* aUnlinker)
+  {
+    static_cast<Unlinker*>(aUnlinker)->loop();
+    return NULL;
+  }
+
+  void
+  Unlinker::loop()
+  {
+    while (true)
+    {
+      size_t lDeleted = 0;
+      try
+      {
+        mongo::ScopedDbConnection lConnection(FUSE.connection_string());
+        lDeleted = reap(*lConnection.get());
+        lConnection.done();
+      }
+      catch (std::exception& e)
+      {
+        syslog(LOG_ERR, "unlinker: %s", e.what());
+      }
+
+      gridfs::Lock lLock(theMutex);
+      if (theStopped)
+        return;
+
+      // a full batch means there are probably more, otherwise let
+      // further unlinks accumulate until woken up
+      if (lDeleted < theBatchSize && !theWakeup)
+      {
+        struct timeval lNow;
+        gettimeofday(&lNow, NULL);
+        struct timespec lTimeout;
+        lTimeout.tv_sec = lNow.tv_sec + UNLINK_INTERVAL;
+        lTimeout.tv_nsec = lNow.tv_usec * 1000;
+
+        while (!theWakeup && !theStopped &&
+            pthread_cond_timedwait(&theCondition, &theMutex, &lTimeout) != ETIMEDOUT)
+          ;
+
+        if (theStopped)
+          return;
+      }
+      theWakeup = false;
+    }
+  }
+
+  size_t
+  Unlinker::reap(mongo::DBClientBase& aConnection)
+  {
+    static const mongo::BSONObj lFields = BSON("_id" << 1);
+
+    // served by the {parent, filename, uploadDate} index
+    std::auto_ptr<mongo::DBClientCursor> lCursor = aConnection.query(
+        theFilesCollection,
+        BSON("parent" << FilesystemEntry::UNLINKED),
+        (int)theBatchSize, 0,
+        &lFields);
+
+    mongo::BSONArrayBuilder lIdsBuilder;
+    size_t lCount = 0;
+    while (lCursor->more())
+    {
+      lIdsBuilder.append(lCursor->next()["_id"]);
+      ++lCount;
+    }
+    lCursor.reset();
+
+    if (lCount == 0)
+      return 0;
+
+    mongo::BSONArray lIds = lIdsBuilder.arr();
+
+    // the chunks first, such that the marked files documents
+    // remain if deleting them fails and are retried later
+    aConnection.remove(theChunksCollection,
+        BSON("files_id" << BSON("$in" << lIds)));
+
+    std::string lError = aConnection.getLastError();
+    if (!lError.empty())
+    {
+      syslog(LOG_ERR, "unlinker: deleting the chunks of %u files failed: %s",
+          (unsigned int)lCount, lError.c_str());
+      return 0;
+    }
+
+    aConnection.remove(theFilesCollection,
+        BSON("_id" << BSON("$in" << lIds)));
+
+    lError = aConnection.getLastError();
+    if (!lError.empty())
+    {
+      syslog(LOG_ERR, "unlinker: deleting %u files failed: %s",
+          (unsigned int)lCount, lError.c_str());
+      return 0;
+    }
+
+    syslog(LOG_DEBUG, "unlinker: deleted %u files", (unsigned int)lCount);
+    return lCount;
+  }
+
+}
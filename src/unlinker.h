@@ -0,0 +1,73 @@
+/*
+ * Copyright 2012 28msec, Inc.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <string>
+
+#include <mongo/client/redef_macros.h> //To fix ill-defined macros
+#include <mongo/client/dbclient.h>
+
+namespace gridfs {
+
+  /**
+   * background thread which deletes unlinked files from mongo.
+   *
+   * unlink (and rmdir, rename, or /proc/rmtree) only marks the files
+   * documents as unlinked with a single update (see
+   * FilesystemEntry::remove), i.e. the entries are gone for every
+   * mount as soon as the update returns. This thread then deletes the
+   * marked documents and their chunks in batches of unlink_batch_size
+   * with two $in deletes per batch.
+   *
+   * Documents marked by other mounts or left over from a crash are
+   * deleted as well because every mount runs one.
+   */
+  class Unlinker
+  {
+    public:
+      Unlinker(size_t aBatchSize);
+
+      ~Unlinker();
+
+      void
+      start();
+
+      // deletes the current batch and stops
+      void
+      stop();
+
+      // documents have been marked, i.e. don't wait for the next round
+      void
+      wakeup();
+
+    private:
+      static void*
+      run(void* aUnlinker);
+
+      void
+      loop();
+
+      // deletes one batch, returns the number of deleted files
+      size_t
+      reap(mongo::DBClientBase& aConnection);
+
+      // forbid copying
+      Unlinker(const Unlinker&);
+      Unlinker& operator=(const Unlinker&);
+
+      size_t          theBatchSize;
+      std::string     theFilesCollection;
+      std::string     theChunksCollection;
+      pthread_t       theThread;
+      bool            theStarted;
+
+      // protects the following members
+      pthread_mutex_t theMutex;
+      pthread_cond_t  theCondition;
+      bool            theWakeup;
+      bool            theStopped;
+  };
+
+}